@@ -35,6 +35,8 @@ public:
     void listen();
 
 private:
+    static const int kMaxAcceptsPerRead = 64;
+
     void handleRead();
 
     EventLoop* M_loop;
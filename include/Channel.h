@@ -8,6 +8,8 @@
 
 #include "Timestamp.h"
 
+#include <assert.h>
+
 class EventLoop;
 
 ///
@@ -22,6 +24,19 @@ public:
     typedef boost::function<void ()> EventCallback;
     typedef boost::function<void (Timestamp)> ReadEventCallback;
 
+    ///
+    /// Dispatch order of active channels within one loop iteration,
+    /// lower value runs first.
+    ///
+    enum Priority
+    {
+        kControlPriority,   // wakeup fd, acceptors
+        kTimerPriority,     // timerfd
+        kLatencyPriority,   // latency-critical connections, the default
+        kBulkPriority,      // bulk transfers
+        kNumPriorities
+    };
+
     Channel(EventLoop* loop, int fd);
     ~Channel();
 
@@ -111,6 +126,30 @@ public:
         return M_events & kReadEvent;
     }
 
+    ///Registers the fd edge-triggered (EPOLLET) with EPollPoller.
+    ///Handlers must then read/write until EAGAIN, PollPoller ignores it.
+    ///Must be called before the channel is added to the loop.
+    void setEdgeTriggered(bool on)
+    {
+        assert(!M_addedToLoop);
+        M_edgeTriggered = on;
+    }
+
+    bool isEdgeTriggered() const 
+    {
+        return M_edgeTriggered;
+    }
+
+    void setPriority(Priority priority)
+    {
+        M_priority = priority;
+    }
+
+    Priority priority() const 
+    {
+        return M_priority;
+    }
+
     //for Poller 
     int index()
     {
@@ -154,6 +193,8 @@ private:
     int M_revents; // it's the received event types of epoll or poll
     int M_index;
     bool M_logHup;  
+    bool M_edgeTriggered;
+    Priority M_priority;
 
     boost::weak_ptr<void> M_tie;
     bool M_tied;
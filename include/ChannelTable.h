@@ -0,0 +1,92 @@
+#ifndef CHANNELTABLE_H
+#define CHANNELTABLE_H
+
+#include <vector>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+class Channel;
+
+///
+/// Channels of a Poller indexed by fd, O(1) lookup in a dense vector.
+///
+/// Every add() bumps the generation of the fd's slot, so a reference
+/// kept as (fd, generation) is detected as stale once the channel is
+/// removed, even if the fd number has been reused since.
+///
+class ChannelTable
+{
+public:
+    ChannelTable()
+        : M_size(0)
+    {
+    }
+
+    /// NULL if no channel is registered with @c fd
+    Channel* find(int fd) const 
+    {
+        if(fd < 0 || static_cast<size_t>(fd) >= M_slots.size())
+        {
+            return NULL;
+        }
+        return M_slots[fd].channel;
+    }
+
+    /// Generation of the slot of @c fd, valid only while find(fd) != NULL.
+    uint32_t generation(int fd) const 
+    {
+        assert(find(fd) != NULL);
+        return M_slots[fd].generation;
+    }
+
+    /// @return the new generation of the slot
+    uint32_t add(int fd, Channel* channel)
+    {
+        assert(fd >= 0 && channel != NULL);
+        if(static_cast<size_t>(fd) >= M_slots.size())
+        {
+            M_slots.resize(fd + 1);
+        }
+        Slot& slot = M_slots[fd];
+        assert(slot.channel == NULL);
+        slot.channel = channel;
+        ++M_size;
+        return ++slot.generation;
+    }
+
+    size_t erase(int fd)
+    {
+        if(find(fd) == NULL)
+        {
+            return 0;
+        }
+        M_slots[fd].channel = NULL;
+        --M_size;
+        return 1;
+    }
+
+    size_t size() const 
+    {
+        return M_size;
+    }
+
+private:
+    struct Slot
+    {
+        Slot()
+            : channel(NULL),
+              generation(0)
+        {
+        }
+
+        Channel* channel;
+        uint32_t generation;
+    };
+
+    std::vector<Slot> M_slots;
+    size_t M_size;
+};
+
+#endif
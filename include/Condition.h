@@ -4,7 +4,10 @@
 #include "Mutex.h"
 
 #include <boost/noncopyable.hpp>
+#include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 class Condition : boost::noncopyable
 {
@@ -26,6 +29,21 @@ class Condition : boost::noncopyable
             pthread_cond_wait(&M_pcond, M_mutex.getPthreadMutex());
         }
 
+        /// returns true if time out, false otherwise.
+        bool waitForSeconds(double seconds)
+        {
+            struct timespec abstime;
+            clock_gettime(CLOCK_REALTIME, &abstime);
+
+            const int64_t kNanoSecondsPerSecond = 1000000000;
+            int64_t nanoseconds = static_cast<int64_t>(seconds * kNanoSecondsPerSecond);
+
+            abstime.tv_sec += static_cast<time_t>((abstime.tv_nsec + nanoseconds) / kNanoSecondsPerSecond);
+            abstime.tv_nsec = static_cast<long>((abstime.tv_nsec + nanoseconds) % kNanoSecondsPerSecond);
+
+            return ETIMEDOUT == pthread_cond_timedwait(&M_pcond, M_mutex.getPthreadMutex(), &abstime);
+        }
+
         void notify()
         {
             pthread_cond_signal(&M_pcond);
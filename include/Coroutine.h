@@ -0,0 +1,659 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// C++20 coroutine API on top of EventLoop and TcpConnection.
+// Opt-in: compiled only with -std=c++20, the rest of the library doesn't need it.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include "Buffer.h"
+#include "Callbacks.h"
+#include "EventLoop.h"
+#include "Mutex.h"
+#include "TcpConnection.h"
+
+#include <assert.h>
+#include <algorithm>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+class TcpClient;
+class TcpServer;
+
+namespace detail
+{
+/// Coroutine frames of the calling thread, ie. of its EventLoop,
+/// recycled per size class. A thread keeps a bounded number of bytes
+/// pooled and frees the rest, and its pool when it exits.
+void* allocateFrame(size_t size);
+void deallocateFrame(void* frame, size_t size);
+
+/// aborts, like an exception escaping a Thread
+void abortOnException();
+
+/// Promise of CoTask<T>, less the result.
+class CoTaskPromiseBase
+{
+public:
+    /// resumes the awaiter, by symmetric transfer so chains of
+    /// co_await don't grow the stack
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            std::coroutine_handle<> continuation = handle.promise().M_continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return std::suspend_always();
+    }
+
+    FinalAwaiter final_suspend() noexcept
+    {
+        return FinalAwaiter();
+    }
+
+    void unhandled_exception()
+    {
+        M_exception = std::current_exception();
+    }
+
+    void setContinuation(std::coroutine_handle<> continuation)
+    {
+        M_continuation = continuation;
+    }
+
+    void rethrowIfFailed()
+    {
+        if(M_exception)
+        {
+            std::rethrow_exception(M_exception);
+        }
+    }
+
+    static void* operator new(size_t size)
+    {
+        return allocateFrame(size);
+    }
+
+    static void operator delete(void* frame, size_t size)
+    {
+        deallocateFrame(frame, size);
+    }
+
+private:
+    std::coroutine_handle<> M_continuation;
+    std::exception_ptr M_exception;
+};
+
+template<typename T>
+class CoTaskPromise : public CoTaskPromiseBase
+{
+public:
+    template<typename U>
+    void return_value(U&& value)
+    {
+        M_value.emplace(std::forward<U>(value));
+    }
+
+    T result()
+    {
+        rethrowIfFailed();
+        return std::move(*M_value);
+    }
+
+private:
+    std::optional<T> M_value;
+};
+
+template<>
+class CoTaskPromise<void> : public CoTaskPromiseBase
+{
+public:
+    void return_void()
+    {
+    }
+
+    void result()
+    {
+        rethrowIfFailed();
+    }
+};
+}
+
+///
+/// Fire-and-forget coroutine.
+///
+/// Runs eagerly in the calling thread until its first suspension,
+/// and is resumed by the loop that completes what it awaits.
+/// The frame comes from the per-thread pool and frees itself at the end.
+/// Starts CoTask<T> chains from plain callbacks.
+///
+class CoDetached
+{
+public:
+    struct promise_type
+    {
+        CoDetached get_return_object()
+        {
+            return CoDetached();
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            detail::abortOnException();
+        }
+
+        static void* operator new(size_t size)
+        {
+            return detail::allocateFrame(size);
+        }
+
+        static void operator delete(void* frame, size_t size)
+        {
+            detail::deallocateFrame(frame, size);
+        }
+    };
+};
+
+///
+/// Lazily started coroutine yielding a @c T to its awaiter.
+///
+/// Starts when co_awaited, in the awaiting thread, and resumes the awaiter
+/// where it finishes, eg. in the loop that completed its last co_await.
+/// An exception escaping it is rethrown from the co_await.
+/// A task never awaited never runs, its frame is freed with the CoTask.
+///
+template<typename T = void>
+class CoTask : boost::noncopyable
+{
+public:
+    class promise_type : public detail::CoTaskPromise<T>
+    {
+    public:
+        CoTask get_return_object()
+        {
+            return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    class Awaiter
+    {
+    public:
+        explicit Awaiter(std::coroutine_handle<promise_type> handle)
+            : M_handle(handle)
+        {
+        }
+
+        bool await_ready() const noexcept
+        {
+            return !M_handle || M_handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            M_handle.promise().setContinuation(awaiting);
+            return M_handle;
+        }
+
+        T await_resume()
+        {
+            assert(M_handle);
+            return M_handle.promise().result();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> M_handle;
+    };
+
+    CoTask(CoTask&& rhs) noexcept
+        : M_handle(rhs.M_handle)
+    {
+        rhs.M_handle = nullptr;
+    }
+
+    ~CoTask()
+    {
+        if(M_handle)
+        {
+            M_handle.destroy();
+        }
+    }
+
+    /// once per task
+    Awaiter operator co_await() const noexcept
+    {
+        return Awaiter(M_handle);
+    }
+
+private:
+    explicit CoTask(std::coroutine_handle<promise_type> handle)
+        : M_handle(handle)
+    {
+    }
+
+    std::coroutine_handle<promise_type> M_handle;
+};
+
+///
+/// co_await sleepFor(loop, seconds), resumes in @c loop's thread.
+///
+class SleepAwaiter
+{
+public:
+    SleepAwaiter(EventLoop* loop, double seconds)
+        : M_loop(loop),
+          M_seconds(seconds)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        M_loop->runAfter(M_seconds, [handle]() { handle.resume(); });
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+private:
+    EventLoop* M_loop;
+    double M_seconds;
+};
+
+inline SleepAwaiter sleepFor(EventLoop* loop, double seconds)
+{
+    return SleepAwaiter(loop, seconds);
+}
+
+///
+/// co_await switchTo(loop), continues in @c loop's thread,
+/// eg. before wrapping a connection accepted on another loop.
+///
+class SwitchAwaiter
+{
+public:
+    explicit SwitchAwaiter(EventLoop* loop)
+        : M_loop(loop)
+    {
+    }
+
+    bool await_ready() const
+    {
+        return M_loop->isInLoopThread();
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        M_loop->queueInLoop([handle]() { handle.resume(); });
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+private:
+    EventLoop* M_loop;
+};
+
+inline SwitchAwaiter switchTo(EventLoop* loop)
+{
+    return SwitchAwaiter(loop);
+}
+
+///
+/// Awaitable reads and writes of one TcpConnection.
+///
+/// Must be created and used in the connection's loop thread, one pending
+/// operation at a time. Takes over the message, write complete and
+/// connection callbacks of the connection, the previous connection
+/// callback is still called.
+///
+class CoConnection
+{
+private:
+    struct State : boost::noncopyable
+    {
+        enum Op { kNone, kRead, kReadUntil, kWrite };
+
+        State()
+            : op(kNone),
+              length(0),
+              closed(false)
+        {
+        }
+
+        /// bytes completing a read, 0 if not yet there
+        static size_t ready(Op op, size_t length, const std::string& delimiter, const Buffer* buf)
+        {
+            if(op == kRead)
+            {
+                return buf->readableBytes() >= length ? length : 0;
+            }
+            const char* begin = buf->peek();
+            const char* end = begin + buf->readableBytes();
+            const char* found = std::search(begin, end, delimiter.begin(), delimiter.end());
+            return found == end ? 0 : static_cast<size_t>(found - begin) + delimiter.size();
+        }
+
+        /// of the pending read
+        size_t ready(const Buffer* buf) const
+        {
+            return ready(op, length, delimiter, buf);
+        }
+
+        void resume()
+        {
+            std::coroutine_handle<> handle = waiter;
+            waiter = nullptr;
+            handle.resume();
+        }
+
+        std::coroutine_handle<> waiter;
+        Op op;
+        size_t length;
+        std::string delimiter;
+        bool closed;
+        ConnectionCallback previous;
+    };
+
+    typedef boost::shared_ptr<State> StatePtr;
+
+public:
+    class ReadAwaiter
+    {
+    public:
+        ReadAwaiter(const TcpConnectionPtr& conn, const StatePtr& state,
+                    State::Op op, size_t length, const std::string& delimiter)
+            : M_conn(conn),
+              M_state(state),
+              M_op(op),
+              M_length(length),
+              M_delimiter(delimiter)
+        {
+        }
+
+        bool await_ready() const
+        {
+            return M_state->closed || readable() > 0;
+        }
+
+        /// the read is pending only while suspended, an awaiter never
+        /// awaited leaves nothing behind
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            assert(M_state->op == State::kNone);
+            M_state->op = M_op;
+            M_state->length = M_length;
+            M_state->delimiter = M_delimiter;
+            M_state->waiter = handle;
+        }
+
+        /// empty if the connection closed first
+        std::string await_resume()
+        {
+            size_t n = readable();
+            M_state->op = State::kNone;
+            return n > 0 ? M_conn->inputBuffer()->retrieveAsString(n) : std::string();
+        }
+
+    private:
+        size_t readable() const
+        {
+            return State::ready(M_op, M_length, M_delimiter, M_conn->inputBuffer());
+        }
+
+        TcpConnectionPtr M_conn;
+        StatePtr M_state;
+        State::Op M_op;
+        size_t M_length;
+        std::string M_delimiter;
+    };
+
+    class WriteAwaiter
+    {
+    public:
+        WriteAwaiter(const TcpConnectionPtr& conn, const StatePtr& state,
+                     const void* data, size_t len)
+            : M_conn(conn),
+              M_state(state),
+              M_data(data),
+              M_len(len)
+        {
+        }
+
+        bool await_ready() const
+        {
+            return M_state->closed || !M_conn->connected();
+        }
+
+        /// sends right away, stays suspended only if the data was not all written
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            assert(M_state->op == State::kNone);
+            M_conn->send(M_data, static_cast<int>(M_len));
+            if(M_conn->outputBuffer()->readableBytes() == 0)
+            {
+                return false;
+            }
+            M_state->op = State::kWrite;
+            M_state->waiter = handle;
+            return true;
+        }
+
+        /// false if the connection closed before all data was written
+        bool await_resume()
+        {
+            M_state->op = State::kNone;
+            return !M_state->closed && M_conn->connected();
+        }
+
+    private:
+        TcpConnectionPtr M_conn;
+        StatePtr M_state;
+        const void* M_data;
+        size_t M_len;
+    };
+
+    explicit CoConnection(const TcpConnectionPtr& conn);
+
+    const TcpConnectionPtr& connection() const
+    {
+        return M_conn;
+    }
+
+    /// co_await read(n) yields exactly @c n bytes
+    ReadAwaiter read(size_t n)
+    {
+        return ReadAwaiter(M_conn, M_state, State::kRead, n, std::string());
+    }
+
+    /// co_await readUntil("\r\n") yields bytes up to and including the delimiter
+    ReadAwaiter readUntil(const std::string& delimiter)
+    {
+        return ReadAwaiter(M_conn, M_state, State::kReadUntil, 0, delimiter);
+    }
+
+    /// @c data must stay valid until the co_await expression completes
+    WriteAwaiter write(const void* data, size_t len)
+    {
+        return WriteAwaiter(M_conn, M_state, data, len);
+    }
+
+    WriteAwaiter write(const std::string& data)
+    {
+        return write(data.data(), data.size());
+    }
+
+    WriteAwaiter write(const Buffer& buf)
+    {
+        return write(buf.peek(), buf.readableBytes());
+    }
+
+private:
+    static void onMessage(const StatePtr& state, const TcpConnectionPtr& conn, Buffer* buf);
+    static void onWriteComplete(const StatePtr& state, const TcpConnectionPtr& conn);
+    static void onConnection(const StatePtr& state, const TcpConnectionPtr& conn);
+
+    TcpConnectionPtr M_conn;
+    StatePtr M_state;
+};
+
+///
+/// co_await connect(client), yields the connection once established,
+/// resumed in the client's loop thread. Takes over the client's
+/// connection and message callbacks, data is kept for a CoConnection.
+///
+class ConnectAwaiter
+{
+public:
+    explicit ConnectAwaiter(TcpClient* client)
+        : M_client(client),
+          M_state(new State)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle);
+
+    TcpConnectionPtr await_resume()
+    {
+        return M_state->conn;
+    }
+
+private:
+    /// shared with the connection callback, which outlives the awaiter
+    /// as the previous callback of a CoConnection
+    struct State
+    {
+        TcpConnectionPtr conn;
+    };
+
+    TcpClient* M_client;
+    boost::shared_ptr<State> M_state;
+};
+
+inline ConnectAwaiter connect(TcpClient* client)
+{
+    return ConnectAwaiter(client);
+}
+
+///
+/// Accepted connections of a TcpServer as an awaitable queue.
+///
+/// Must be created before TcpServer::start(), takes over its connection
+/// and message callbacks, data is kept for a CoConnection.
+/// co_await accept() resumes in the awaiting thread's loop, the connection
+/// belongs to its own I/O loop, co_await switchTo(conn->getLoop()) first.
+///
+/// The server and its connections share the acceptor's state, so it may
+/// be destroyed before them. Connections not accept()ed by then, or coming
+/// in later, are closed, except one for a coroutine already awaiting.
+///
+class CoAcceptor : boost::noncopyable
+{
+private:
+    class State;
+    typedef boost::shared_ptr<State> StatePtr;
+
+public:
+    class AcceptAwaiter
+    {
+    public:
+        explicit AcceptAwaiter(const StatePtr& state)
+            : M_state(state)
+        {
+        }
+
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> handle);
+
+        TcpConnectionPtr await_resume()
+        {
+            return M_conn;
+        }
+
+    private:
+        friend class CoAcceptor;
+        StatePtr M_state;
+        TcpConnectionPtr M_conn;
+    };
+
+    explicit CoAcceptor(TcpServer* server);
+    ~CoAcceptor();
+
+    /// one awaiting coroutine at a time
+    AcceptAwaiter accept()
+    {
+        return AcceptAwaiter(M_state);
+    }
+
+private:
+    class State : boost::noncopyable
+    {
+    public:
+        State()
+            : waiter(NULL),
+              waiterLoop(NULL),
+              destroyed(false)
+        {
+        }
+
+        MutexLock mutex;
+        std::deque<TcpConnectionPtr> accepted;  // @GuardedBy mutex
+        AcceptAwaiter* waiter;                  // @GuardedBy mutex
+        std::coroutine_handle<> waiterHandle;   // @GuardedBy mutex
+        EventLoop* waiterLoop;                  // @GuardedBy mutex
+        bool destroyed;                         // @GuardedBy mutex, no more accept()
+    };
+
+    static void onConnection(const StatePtr& state, const TcpConnectionPtr& conn);
+
+    StatePtr M_state;
+};
+
+#endif  // C++20 coroutines
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef COUNTDOWNLATCH_H
+#define COUNTDOWNLATCH_H
+
+#include "Condition.h"
+#include "Mutex.h"
+
+#include <boost/noncopyable.hpp>
+
+class CountDownLatch : boost::noncopyable
+{
+public:
+    explicit CountDownLatch(int count);
+
+    void wait();
+
+    void countDown();
+
+    int getCount() const;
+
+private:
+    mutable MutexLock M_mutex;
+    Condition M_condition;
+    int M_count;
+};
+
+#endif
@@ -19,6 +19,7 @@ public:
     virtual ~EPollPoller();
 
     virtual Timestamp poll(int timeoutMs, ChannelList* activeChannels);
+    virtual Timestamp pollPrecise(int64_t timeoutNs, ChannelList* activeChannels);
     virtual void updateChannel(Channel* channel);
     virtual void removeChannel(Channel* channel);
 
@@ -27,14 +28,36 @@ private:
 
     static const char* operationToString(int op);
 
+    static int interestOf(const Channel* channel);
+
+    Timestamp collectEvents(int numEvents, int savedErrno,
+                            ChannelList* activeChannels);
     void fillActiveChannels(int numEvents,
                             ChannelList* activeChannels) const 
+    void applyPendingUpdates();
     void update(int operation, Channel* channel);
 
     typedef std::vector<struct epoll_event> EventList;
 
+    /// Interest of an fd as the kernel knows it, indexed by fd.
+    struct Interest
+    {
+        Interest()
+            : events(0),
+              registered(false),
+              dirty(false)
+        {
+        }
+
+        int events;
+        bool registered;
+        bool dirty;  // in M_dirtyFds
+    };
+
     int M_epollfd;
     EventList M_events;                        
+    std::vector<Interest> M_interests;
+    std::vector<int> M_dirtyFds;
 
 };
 
@@ -1,6 +1,7 @@
 #ifndef EVENTLOOP_H
 #define EVENTLOOP_H
 
+#include <deque>
 #include <vector>
 
 #include <boost/any.hpp>
@@ -12,7 +13,13 @@
 #include "CurrentThread.h"
 #include "TimeStamp.h"
 #include "Callbacks.h"
+#include "TimerEngine.h"
 #include "TimerId.h"
+#include "TimerSpec.h"
+
+#ifdef MUDUO_EVENTLOOP_STATS
+#include "EventLoopStats.h"
+#endif
 
 
 class Channel;
@@ -51,9 +58,36 @@ public:
         return M_pollReturnTime;
     }
 
+    ///
+    /// Loop time, read once per iteration when poll returns, free to call.
+    /// Lags real time by the handlers run so far in this iteration.
+    /// Only meaningful in the loop thread.
+    ///
+    Timestamp now() const 
+    {
+        return M_pollReturnTime;
+    }
+
+    ///
+    /// Current time, from FastClock, ie. the TSC if it was enabled.
+    /// Safe to call from other threads.
+    ///
+    Timestamp preciseNow() const;
+
+    ///
+    /// Loop time on CLOCK_MONOTONIC, the clock of timers, read at the
+    /// first call in an iteration. Only meaningful in the loop thread.
+    ///
+    Timestamp monotonicNow() const;
+
+    /// Current time on CLOCK_MONOTONIC, from FastClock::monotonicNow().
+    /// Safe to call from other threads.
+    Timestamp preciseMonotonicNow() const;
+
+    /// Number of poll() returns so far. Safe to read from other threads.
     int64_t iteration() const 
     {
-        return M_iteration;
+        return __atomic_load_n(&M_iteration, __ATOMIC_RELAXED);
     }
 
     /// Runs callback immediately in the loop thread.
@@ -67,27 +101,54 @@ public:
     /// Safe to call from other threads.
     void queueInLoop(const Functor &cb);
 
+    /// Functors queued, including those deferred by the functor budget.
     size_t queueSize() const;
 
     //timers
+    //
+    // Timers run on CLOCK_MONOTONIC, a step of the wall clock doesn't
+    // fire them early or late.
+    // @c slack is how many seconds late the callback may run, letting
+    // timers share a wakeup instead of reprogramming the timerfd each.
 
     ///
-    /// Runs callback at 'time'. 
+    /// Runs callback at wall clock 'time', as mapped onto the
+    /// monotonic clock when called.
     /// Safe to call from other threads.
     ///
-    TimerId runAt(const Timestamp& time, const TimerCallback& cb);
+    TimerId runAt(const Timestamp& time, const TimerCallback& cb, double slack = 0.0);
 
     ///
-    /// Runs callback after @c delay seconds.
+    /// Runs callback after @c delay seconds, counted from loop time monotonicNow()
+    /// in the loop thread, from preciseMonotonicNow() in other threads.
     /// Safe to call from other threads.
     ///
-    TimerId runAfter(double delay, const TimerCallback& cb)；
+    TimerId runAfter(double delay, const TimerCallback& cb, double slack = 0.0);
 
     ///
     /// Runs callback every @c interval seconds. 
     /// Safe to call from other threads. 
     ///
-    TimerId runEvery(double interval, const TimerCallback& cb);
+    TimerId runEvery(double interval, const TimerCallback& cb, double slack = 0.0);
+
+    ///
+    /// High resolution timers, for pacing and microsecond retries.
+    /// While one is pending the loop polls with a nanosecond timeout
+    /// (epoll_pwait2, or ppoll) that ends a little before it is due,
+    /// then spins to the deadline and runs it before handling channels.
+    /// The loop thread's timer slack is set to 1ns at the first one.
+    /// Safe to call from other threads.
+    ///
+    TimerId runAtPrecise(const Timestamp& time, const TimerCallback& cb);
+    TimerId runAfterPrecise(double delay, const TimerCallback& cb);
+    TimerId runEveryPrecise(double interval, const TimerCallback& cb);
+
+    ///
+    /// How long before a high resolution timer is due the loop stops
+    /// blocking and spins, to cover the wakeup latency, 20us by default.
+    /// Must be called in the loop thread.
+    ///
+    void setPreciseTimerSpin(double seconds);
 
     ///
     /// Cancels the timer. 
@@ -95,6 +156,62 @@ public:
     ///
     void cancel(TimerId timerId);
 
+    ///
+    /// Schedules a batch of timers with one handoff to the loop,
+    /// returns their ids in order.
+    /// Safe to call from other threads.
+    ///
+    std::vector<TimerId> addTimers(const std::vector<TimerSpec>& timers);
+
+    ///
+    /// Cancels a batch of timers with one handoff to the loop.
+    /// Safe to call from other threads.
+    ///
+    void cancel(const std::vector<TimerId>& timerIds);
+
+    ///
+    /// Selects how this loop keeps its timers, @c tickSeconds is the
+    /// resolution of TimerEngine::kWheelEngine. The default is chosen by
+    /// TimerEngine::newDefaultTimerEngine().
+    /// Must be called in the loop thread before any timer is added,
+    /// eg. in the ThreadInitCallback.
+    ///
+    void setTimerEngine(TimerEngine::Kind kind, double tickSeconds = 0.001);
+
+    ///
+    /// Drives timers from the poll timeout instead of a timerfd, expired
+    /// ones run after I/O dispatch. Saves a read(2) per expiry and a
+    /// timerfd_settime() per reschedule, for loops with dense timers.
+    /// The poll timeout is in milliseconds, rounded up, so timers may run
+    /// up to a millisecond late; use the high resolution ones below that.
+    /// The default is set by env MUDUO_POLL_DRIVEN_TIMERS.
+    /// Must be called in the loop thread, not from a timer callback.
+    ///
+    void setPollDrivenTimers(bool on);
+
+    /// timerfd reprograms made and saved by timer slack.
+    /// Safe to call from other threads.
+    int64_t timerReprograms() const;
+    int64_t timerReprogramsSaved() const;
+
+    ///
+    /// Limits the time spent per iteration in handlers of channels
+    /// of class @c priority (a Channel::Priority), 0.0 means no limit.
+    /// Level-triggered channels left over are reported again by the next poll,
+    /// edge-triggered ones are always dispatched.
+    /// Must be called in the loop thread.
+    ///
+    void setPriorityBudget(int priority, double seconds);
+
+    ///
+    /// Limits the pending functors run per iteration to @c maxFunctors
+    /// and to about @c seconds, 0 means no limit. Functors left over run
+    /// first in the next iteration, whose poll doesn't block, so a flood
+    /// of queueInLoop() can't starve I/O.
+    /// Must be called in the loop thread.
+    ///
+    void setFunctorBudget(size_t maxFunctors, double seconds);
+
 
     // internal usage
     void wakeup();
@@ -120,6 +237,32 @@ public:
         return M_eventHandling;
     }
 
+    pid_t threadId() const 
+    {
+        return M_threadId;
+    }
+
+    ///
+    /// Progress of the loop, for LoopWatchdog. Safe to read from other threads.
+    ///
+    /// Time in microseconds since epoch when poll() last returned,
+    /// 0 while the loop is blocked in poll().
+    int64_t busySince() const 
+    {
+        return __atomic_load_n(&M_busySince, __ATOMIC_RELAXED);
+    }
+
+    /// fd of the channel being handled, -1 if none, eg. in pending functors.
+    int activeFd() const 
+    {
+        return __atomic_load_n(&M_activeFd, __ATOMIC_RELAXED);
+    }
+
+    bool callingPendingFunctors() const 
+    {
+        return __atomic_load_n(&M_callingPendingFunctors, __ATOMIC_RELAXED);
+    }
+
     void setContext(const boost::any& context)
     {
         M_context = context;
@@ -137,10 +280,40 @@ public:
 
     static EventLoop* getEventLoopOfCurrentThread();
 
+#ifdef MUDUO_EVENTLOOP_STATS
+    /// Histograms of this loop, safe to snapshot from other threads.
+    const EventLoopStats& stats() const 
+    {
+        return M_stats;
+    }
+#endif
+
   private:
     void abortNotInLoopThread();
     void handleRead(); //waked up
     void doPendingFunctors();
+    bool functorBudgetExceeded(size_t ran, int64_t elapsedUs) const;
+    void dispatchActiveChannels();
+    Timestamp timerBase() const;
+    int64_t pollTimeoutNs(Timestamp preciseWakeup, Timestamp timerWakeup);
+    int pollTimeoutMs(Timestamp timerWakeup);
+    void runPreciseTimers(Timestamp wakeup);
+    void setPreciseTimerSlack(bool on);
+
+    void setBusySince(int64_t microseconds)
+    {
+        __atomic_store_n(&M_busySince, microseconds, __ATOMIC_RELAXED);
+    }
+
+    void setActiveFd(int fd)
+    {
+        __atomic_store_n(&M_activeFd, fd, __ATOMIC_RELAXED);
+    }
+
+    void setCallingPendingFunctors(bool on)
+    {
+        __atomic_store_n(&M_callingPendingFunctors, on, __ATOMIC_RELAXED);
+    }
 
     void printActiveChannels() const; //DEBUG
 
@@ -149,10 +322,14 @@ public:
     bool M_looping;
     bool M_quit;
     bool M_eventHandling;
-    bool M_callingPendingFunctors;
-    int64_t M_iteration;
+    bool M_callingPendingFunctors;  // atomic
+    int64_t M_iteration;            // atomic
     const pid_t M_threadId;
     Timestamp M_pollReturnTime;
+    mutable Timestamp M_monotonicNow;       // read lazily, at M_monotonicIteration
+    mutable int64_t M_monotonicIteration;
+    int64_t M_busySince;  // atomic
+    int M_activeFd;       // atomic
     boost::scoped_ptr<Poller> M_poller;
     boost::scoped_ptr<TimerQueue> M_timerQueue;
     int M_wakeupFd;
@@ -164,9 +341,25 @@ public:
     //scratch variables
     ChannelList M_activeChannels;
     Channel* M_currentActiveChannel;
+    std::vector<ChannelList> M_priorityChannels;  // indexed by Channel::Priority
+    std::vector<int64_t> M_priorityBudgets;       // in microseconds, 0 for unlimited
+
+    int64_t M_preciseSpinUs;
+    bool M_preciseTimerSlack;     // timer slack lowered for precise timers
+    unsigned long M_savedTimerSlack;  // the thread's own, to restore
+
+    size_t M_functorBudgetCount;  // 0 for unlimited
+    int64_t M_functorBudgetUs;    // 0 for unlimited
+    std::deque<Functor> M_deferredFunctors;  // over the budget, loop thread only
+    size_t M_deferredCount;       // atomic, M_deferredFunctors.size() for queueSize()
 
     mutable MutexLock M_mutex;
     std::vector<Functor> M_pendingFunctors;
+#ifdef MUDUO_EVENTLOOP_STATS
+    std::vector<int64_t> M_pendingEnqueueTimes;  // parallel to M_pendingFunctors
+    std::deque<int64_t> M_deferredEnqueueTimes;  // parallel to M_deferredFunctors
+    EventLoopStats M_stats;
+#endif
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,28 @@
+#ifndef EVENTLOOPSTATS_H
+#define EVENTLOOPSTATS_H
+
+#include "Channel.h"
+#include "Histogram.h"
+
+#include <boost/noncopyable.hpp>
+
+///
+/// Histograms of one EventLoop, recorded when built with MUDUO_EVENTLOOP_STATS.
+///
+/// Written by the loop thread only, any thread may snapshot() them.
+/// Times are in microseconds.
+///
+struct EventLoopStats : boost::noncopyable
+{
+    Histogram iteration;        // poll return to end of doPendingFunctors
+    Histogram pollWait;         // blocked in Poller::poll
+    Histogram handler[Channel::kNumPriorities];  // one handleEvent, by channel class
+    Histogram pendingFunctors;  // one non-empty doPendingFunctors
+    Histogram queueDepth;       // functors per doPendingFunctors, a count
+    Histogram queueDelay;       // queueInLoop to run, per functor, including deferral
+    Histogram deferredFunctors; // left over the functor budget, a count
+    Histogram timerLateness;    // expiration to run, per timerfd timer
+    Histogram preciseTimerLateness;  // expiration to run, per high resolution timer
+};
+
+#endif
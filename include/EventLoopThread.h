@@ -5,6 +5,7 @@
 #include "Condition.h"
 #include "Mutex.h"
 #include "Thread.h"
+#include "ThreadPlacement.h"
 
 #include <boost/noncopyable.hpp>
 
@@ -20,6 +21,14 @@ public:
     ~EventLoopThread();
     EventLoop* startLoop();
 
+    /// Applied by the loop thread to itself before it creates its EventLoop,
+    /// as thread @c index of its pool. Must be called before startLoop().
+    void setPlacement(const ThreadPlacement& placement, int index)
+    {
+        M_placement = placement;
+        M_placementIndex = index;
+    }
+
 private:
     void threadFunc();
 
@@ -29,6 +38,8 @@ private:
     MutexLock M_mutex;
     Condition M_cond;
     ThreadInitCallback M_callback;              
+    ThreadPlacement M_placement;
+    int M_placementIndex;
 };
 
 
@@ -1,6 +1,7 @@
 #ifndef EVENTLOOPTHREADPOOL_H
 #define EVENTLOOPTHREADPOOL_H
 
+#include "ThreadPlacement.h"
 #include "Types.h"
 
 #include <vector>
@@ -22,6 +23,13 @@ public:
     {
         M_numThreads = numThreads;
     }
+
+    /// Pins loop threads, see ThreadPlacement. Must be called before start().
+    void setPlacement(const ThreadPlacement& placement)
+    {
+        M_placement = placement;
+    }
+
     void start(const ThreadInitCallback &cb = ThreadInitCallback());
 
     // valid after calling start()
@@ -50,6 +58,7 @@ private:
     bool M_started;
     int M_numThreads;
     int M_next;
+    ThreadPlacement M_placement;
     boost::ptr_vector<EventLoopThread> M_threads;
     std::vector<EventLoop*> M_loops;
 };
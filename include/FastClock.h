@@ -0,0 +1,43 @@
+#ifndef FASTCLOCK_H
+#define FASTCLOCK_H
+
+#include "Timestamp.h"
+
+///
+/// Cheap source of Timestamp, from the TSC once enabled.
+///
+/// The tick rate is calibrated once against CLOCK_MONOTONIC, each thread
+/// anchors the TSC to gettimeofday() and re-anchors every second, so readings
+/// stay in the Timestamp::now() domain, within drift of a microsecond or so.
+/// Until enabled, or where there is no invariant TSC, it is Timestamp::now().
+///
+/// monotonicNow() is the same for CLOCK_MONOTONIC, a Timestamp counted
+/// from an unspecified start that never steps, for timers. Within a thread
+/// it never goes backward, a re-anchor that would step it back holds it at
+/// the last reading instead.
+///
+class FastClock
+{
+public:
+    ///
+    /// Calibrates the TSC, takes about 20ms. Call once at startup,
+    /// before loops start. Returns false if the TSC isn't usable.
+    ///
+    static bool enable();
+
+    static bool enabled();
+
+    static Timestamp now();
+
+    static Timestamp monotonicNow();
+
+    /// CLOCK_MONOTONIC read from the kernel, the clock timerfds fire on.
+    /// monotonicNow() may lag it by up to the re-anchor drift.
+    static Timestamp systemMonotonicNow();
+
+    /// Moves a Timestamp::now() time to the monotonicNow() domain,
+    /// as of the current offset between the two clocks.
+    static Timestamp toMonotonic(Timestamp wallTime);
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef HEAPTIMERENGINE_H
+#define HEAPTIMERENGINE_H
+
+#include "TimerEngine.h"
+
+///
+/// 4-ary min-heap of (expiration, Timer*), exact expiration order.
+///
+/// Each Timer keeps its heap position, so cancel is O(log n) without
+/// a lookup. Expirations sit in the heap array next to the
+/// pointers, sifting doesn't touch the Timers.
+///
+class HeapTimerEngine : public TimerEngine
+{
+public:
+    HeapTimerEngine();
+    virtual ~HeapTimerEngine();
+
+    virtual bool insert(Timer* timer);
+    virtual void cancel(Timer* timer);
+    virtual void getExpired(Timestamp now, std::vector<Timer*>* expired);
+    virtual Timestamp nextWakeup();
+
+    virtual size_t size() const
+    {
+        return M_heap.size();
+    }
+
+private:
+    static const size_t kArity = 4;
+
+    struct Node
+    {
+        int64_t expiration;  // microseconds since epoch
+        Timer* timer;
+    };
+
+    void siftUp(size_t index);
+    void siftDown(size_t index);
+    void removeAt(size_t index);
+    void set(size_t index, const Node& node);
+
+    std::vector<Node> M_heap;
+};
+
+#endif
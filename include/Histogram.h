@@ -0,0 +1,86 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "Types.h"
+
+#include <boost/noncopyable.hpp>
+
+///
+/// Log2-bucketed histogram of non-negative samples, eg. latencies in microseconds.
+///
+/// Single writer, usually the owner loop thread, any thread may take a snapshot.
+/// Counters are published with relaxed atomic stores, so recording takes
+/// no lock and no locked read-modify-write.
+///
+class Histogram : boost::noncopyable
+{
+public:
+    /// bucket 0 holds 0, bucket i holds [2^(i-1), 2^i)
+    static const int kNumBuckets = 40;
+
+    struct Snapshot
+    {
+        int64_t count;
+        int64_t sum;
+        int64_t max;
+        int64_t buckets[kNumBuckets];
+
+        double mean() const;
+        /// upper bound of the bucket holding the @c p quantile, 0.0 < p <= 1.0
+        int64_t percentile(double p) const;
+        string toString() const;
+        /// adds the samples of @c other, eg. the same histogram of another thread
+        void merge(const Snapshot& other);
+    };
+
+    Histogram();
+
+    /// Not thread safe, single writer only.
+    void record(int64_t value)
+    {
+        if(value < 0)
+        {
+            value = 0;
+        }
+        int64_t* bucket = &M_buckets[bucketOf(value)];
+        store(bucket, load(bucket) + 1);
+        store(&M_count, load(&M_count) + 1);
+        store(&M_sum, load(&M_sum) + value);
+        if(value > load(&M_max))
+        {
+            store(&M_max, value);
+        }
+    }
+
+    /// Thread safe, counters of one snapshot may be off by the samples
+    /// recorded while it is taken.
+    Snapshot snapshot() const;
+
+    static int bucketOf(int64_t value)
+    {
+        if(value == 0)
+        {
+            return 0;
+        }
+        int b = 64 - __builtin_clzll(static_cast<unsigned long long>(value));
+        return b < kNumBuckets ? b : kNumBuckets - 1;
+    }
+
+private:
+    static int64_t load(const int64_t* p)
+    {
+        return __atomic_load_n(p, __ATOMIC_RELAXED);
+    }
+
+    static void store(int64_t* p, int64_t v)
+    {
+        __atomic_store_n(p, v, __ATOMIC_RELAXED);
+    }
+
+    int64_t M_count;
+    int64_t M_sum;
+    int64_t M_max;
+    int64_t M_buckets[kNumBuckets];
+};
+
+#endif
@@ -0,0 +1,392 @@
+#ifndef LOOPFUTURE_H
+#define LOOPFUTURE_H
+
+#include "EventLoop.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+
+template<typename T> class LoopFuture;
+template<typename T> class LoopPromise;
+
+namespace detail
+{
+
+///
+/// Single value, single continuation. Whichever of setValue() and
+/// setContinuation() comes second hands the continuation to its loop,
+/// decided by one CAS, no mutex, no condition.
+///
+template<typename T>
+class LoopFutureState : public boost::enable_shared_from_this<LoopFutureState<T> >,
+                        boost::noncopyable
+{
+public:
+    typedef boost::function<void (const T&)> Continuation;
+
+    LoopFutureState()
+        : M_state(kEmpty),
+          M_loop(NULL)
+    {
+    }
+
+    void setValue(const T& value)
+    {
+        assert(!M_value);
+        M_value = value;
+        int old = __sync_val_compare_and_swap(&M_state, kEmpty, kHasValue);
+        if(old == kHasContinuation)
+        {
+            dispatch();
+        }
+        else
+        {
+            assert(old == kEmpty);
+        }
+    }
+
+    void setContinuation(EventLoop* loop, const Continuation& cb)
+    {
+        assert(M_loop == NULL);
+        M_loop = loop;
+        M_continuation = cb;
+        int old = __sync_val_compare_and_swap(&M_state, kEmpty, kHasContinuation);
+        if(old == kHasValue)
+        {
+            dispatch();
+        }
+        else
+        {
+            assert(old == kEmpty);
+        }
+    }
+
+private:
+    enum { kEmpty, kHasValue, kHasContinuation };
+
+    void dispatch()
+    {
+        M_loop->runInLoop(boost::bind(&LoopFutureState::invoke, this->shared_from_this()));
+    }
+
+    void invoke()
+    {
+        Continuation cb;
+        cb.swap(M_continuation);  // drop captured state once run
+        cb(*M_value);
+    }
+
+    int M_state;
+    boost::optional<T> M_value;
+    EventLoop* M_loop;
+    Continuation M_continuation;
+};
+
+// value of LoopFutureState<VoidValue>, behind LoopFuture<void>
+struct VoidValue
+{
+};
+
+inline void ignoreValue(const boost::function<void ()>& cb, const VoidValue&)
+{
+    cb();
+}
+
+/// Prints what @c f threw and aborts, a chain must not hang on it.
+void abortOnFutureException();
+
+// completes a promise with the result of f, void results included
+template<typename U>
+struct FutureResult
+{
+    template<typename Promise, typename F>
+    static void set(const Promise& promise, const F& f)
+    {
+        promise.setValue(f());
+    }
+
+    template<typename Promise, typename F, typename A>
+    static void set(const Promise& promise, const F& f, const A& arg)
+    {
+        promise.setValue(f(arg));
+    }
+};
+
+template<>
+struct FutureResult<void>
+{
+    template<typename Promise, typename F>
+    static void set(const Promise& promise, const F& f)
+    {
+        f();
+        promise.setValue();
+    }
+
+    template<typename Promise, typename F, typename A>
+    static void set(const Promise& promise, const F& f, const A& arg)
+    {
+        f(arg);
+        promise.setValue();
+    }
+};
+
+template<typename T, typename U>
+void chainFuture(LoopPromise<U> next, const boost::function<U (const T&)>& f, const T& value)
+{
+    try
+    {
+        FutureResult<U>::set(next, f, value);
+    }
+    catch(...)
+    {
+        abortOnFutureException();
+    }
+}
+
+template<typename T>
+void fulfillFuture(LoopPromise<T> promise, const boost::function<T ()>& f)
+{
+    try
+    {
+        FutureResult<T>::set(promise, f);
+    }
+    catch(...)
+    {
+        abortOnFutureException();
+    }
+}
+
+template<typename T>
+struct WhenAllState : boost::noncopyable
+{
+    explicit WhenAllState(size_t n)
+        : results(n),
+          remaining(n)
+    {
+    }
+
+    std::vector<T> results;
+    size_t remaining;
+    LoopPromise<std::vector<T> > promise;
+};
+
+// runs in the target loop, no atomics needed
+template<typename T>
+void collectAll(const boost::shared_ptr<WhenAllState<T> >& state, size_t index, const T& value)
+{
+    state->results[index] = value;
+    if(--state->remaining == 0)
+    {
+        state->promise.setValue(state->results);
+    }
+}
+
+template<typename T>
+struct WhenAnyState : boost::noncopyable
+{
+    WhenAnyState()
+        : done(false)
+    {
+    }
+
+    bool done;
+    LoopPromise<std::pair<size_t, T> > promise;
+};
+
+template<typename T>
+void collectAny(const boost::shared_ptr<WhenAnyState<T> >& state, size_t index, const T& value)
+{
+    if(!state->done)
+    {
+        state->done = true;
+        state->promise.setValue(std::make_pair(index, value));
+    }
+}
+
+}
+
+///
+/// Result of work posted to an EventLoop, its continuation runs on a
+/// loop of the caller's choice. One value, one continuation;
+/// copies share the same state.
+///
+/// Functions run for a value, by runInLoopFuture() or then(), must not
+/// throw: nothing would complete the future, so an exception aborts.
+///
+template<typename T>
+class LoopFuture
+{
+public:
+    typedef boost::function<void (const T&)> Continuation;
+
+    /// Runs @c cb with the value in @c loop's thread. Safe to call from other threads.
+    void then(EventLoop* loop, const Continuation& cb) const
+    {
+        M_state->setContinuation(loop, cb);
+    }
+
+    /// Runs @c f with the value in @c loop's thread, its result completes the returned future.
+    /// eg. future.then<int>(loop, boost::bind(&parse, _1)), then<void>() for an f returning void.
+    template<typename U>
+    LoopFuture<U> then(EventLoop* loop, const boost::function<U (const T&)>& f) const
+    {
+        LoopPromise<U> next;
+        M_state->setContinuation(loop, boost::bind(&detail::chainFuture<T, U>, next, f, _1));
+        return next.future();
+    }
+
+private:
+    friend class LoopPromise<T>;
+
+    explicit LoopFuture(const boost::shared_ptr<detail::LoopFutureState<T> >& state)
+        : M_state(state)
+    {
+    }
+
+    boost::shared_ptr<detail::LoopFutureState<T> > M_state;
+};
+
+///
+/// Producer side of a LoopFuture, setValue() at most once, from any thread.
+///
+template<typename T>
+class LoopPromise
+{
+public:
+    LoopPromise()
+        : M_state(new detail::LoopFutureState<T>)
+    {
+    }
+
+    LoopFuture<T> future() const
+    {
+        return LoopFuture<T>(M_state);
+    }
+
+    void setValue(const T& value) const
+    {
+        M_state->setValue(value);
+    }
+
+private:
+    boost::shared_ptr<detail::LoopFutureState<T> > M_state;
+};
+
+///
+/// Completion of work with no result.
+///
+template<>
+class LoopFuture<void>
+{
+public:
+    typedef boost::function<void ()> Continuation;
+
+    /// Runs @c cb in @c loop's thread once complete. Safe to call from other threads.
+    void then(EventLoop* loop, const Continuation& cb) const
+    {
+        M_state->setContinuation(loop, boost::bind(&detail::ignoreValue, cb, _1));
+    }
+
+    /// Runs @c f in @c loop's thread once complete, its result completes the returned future.
+    template<typename U>
+    LoopFuture<U> then(EventLoop* loop, const boost::function<U ()>& f) const
+    {
+        LoopPromise<U> next;
+        M_state->setContinuation(loop, boost::bind(&detail::fulfillFuture<U>, next, f));
+        return next.future();
+    }
+
+private:
+    friend class LoopPromise<void>;
+
+    explicit LoopFuture(const boost::shared_ptr<detail::LoopFutureState<detail::VoidValue> >& state)
+        : M_state(state)
+    {
+    }
+
+    boost::shared_ptr<detail::LoopFutureState<detail::VoidValue> > M_state;
+};
+
+template<>
+class LoopPromise<void>
+{
+public:
+    LoopPromise()
+        : M_state(new detail::LoopFutureState<detail::VoidValue>)
+    {
+    }
+
+    LoopFuture<void> future() const
+    {
+        return LoopFuture<void>(M_state);
+    }
+
+    void setValue() const
+    {
+        M_state->setValue(detail::VoidValue());
+    }
+
+private:
+    boost::shared_ptr<detail::LoopFutureState<detail::VoidValue> > M_state;
+};
+
+///
+/// EventLoop::runInLoop() that returns the result of @c f as a LoopFuture.
+/// eg. runInLoopFuture<int>(loopA, f).then<string>(loopB, g).then(loopC, h)
+/// runInLoopFuture<void>() completes once @c f has run.
+///
+template<typename T>
+LoopFuture<T> runInLoopFuture(EventLoop* loop, const boost::function<T ()>& f)
+{
+    LoopPromise<T> promise;
+    loop->runInLoop(boost::bind(&detail::fulfillFuture<T>, promise, f));
+    return promise.future();
+}
+
+///
+/// Completes in @c loop's thread once all @c futures have, values in order.
+/// whenAll() and whenAny() take futures with a value, not LoopFuture<void>.
+///
+template<typename T>
+LoopFuture<std::vector<T> > whenAll(EventLoop* loop, const std::vector<LoopFuture<T> >& futures)
+{
+    boost::shared_ptr<detail::WhenAllState<T> > state(new detail::WhenAllState<T>(futures.size()));
+    LoopFuture<std::vector<T> > result = state->promise.future();
+    if(futures.empty())
+    {
+        state->promise.setValue(state->results);
+    }
+    for(size_t i = 0; i < futures.size(); ++i)
+    {
+        futures[i].then(loop, boost::bind(&detail::collectAll<T>, state, i, _1));
+    }
+    return result;
+}
+
+///
+/// Completes in @c loop's thread with the index and value of the first of
+/// @c futures to complete, which must not be empty.
+///
+template<typename T>
+LoopFuture<std::pair<size_t, T> > whenAny(EventLoop* loop, const std::vector<LoopFuture<T> >& futures)
+{
+    assert(!futures.empty());
+    boost::shared_ptr<detail::WhenAnyState<T> > state(new detail::WhenAnyState<T>);
+    LoopFuture<std::pair<size_t, T> > result = state->promise.future();
+    for(size_t i = 0; i < futures.size(); ++i)
+    {
+        futures[i].then(loop, boost::bind(&detail::collectAny<T>, state, i, _1));
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef LOOPWATCHDOG_H
+#define LOOPWATCHDOG_H
+
+#include "Mutex.h"
+#include "Thread.h"
+#include "Types.h"
+
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+class EventLoop;
+
+///
+/// Watches EventLoops from its own thread and reports stalls.
+///
+/// A loop is stalled when it has been out of poll() on the same iteration
+/// for longer than the stall budget, eg. a message callback blocking.
+/// The report names the fd and peer being handled, or pending functors,
+/// and carries a stack sample of the loop thread taken with a signal.
+/// The loop keeps running while the report is made, so fd may be stale:
+/// closed, or even reused, by the time the callback sees it.
+///
+class LoopWatchdog : boost::noncopyable
+{
+public:
+    struct StallReport
+    {
+        string loopName;
+        pid_t threadId;
+        int64_t stalledUs;
+        int fd;               // -1 if not in a channel handler
+        string peer;          // peer address of fd, if it's a connected socket
+                              // and the loop was still handling fd after reading it
+        bool inPendingFunctors;
+        string stackTrace;    // empty if sampling is disabled or timed out
+    };
+
+    struct Stats
+    {
+        int64_t stallCount;
+        int64_t totalStallUs;
+        int64_t maxStallUs;
+    };
+
+    typedef boost::function<void (const StallReport&)> StallCallback;
+
+    explicit LoopWatchdog(double stallBudgetSeconds,
+                          const string& nameArg = string("LoopWatchdog"));
+    ~LoopWatchdog();
+
+    /// Default logs the report with LOG_WARN.
+    /// Called in the watchdog thread. Must be called before start().
+    void setStallCallback(const StallCallback& cb)
+    {
+        M_stallCallback = cb;
+    }
+
+    /// Signal used to sample the stack of a stalled loop thread,
+    /// SIGUSR2 by default, 0 disables sampling.
+    /// Must be called before start().
+    ///
+    /// start() installs a process wide handler for it, which stays installed.
+    /// The handler installed before, if any, still gets every instance of
+    /// the signal not sent by a watchdog; one left at SIG_DFL or SIG_IGN
+    /// means those are ignored. Pick a signal the application doesn't use
+    /// if it relies on the default action.
+    void setStackSampleSignal(int signo)
+    {
+        M_sampleSignal = signo;
+    }
+
+    void start();
+    void stop();
+
+    /// Thread safe.
+    void watch(EventLoop* loop, const string& loopName);
+    /// Thread safe. Must be called before the loop destructs.
+    void unwatch(EventLoop* loop);
+
+    /// Thread safe. Stall counts and durations of @c loop, all zero if not watched.
+    /// A stall still going on counts, with its duration so far.
+    Stats stats(EventLoop* loop) const;
+
+private:
+    struct WatchedLoop
+    {
+        EventLoop* loop;
+        string name;
+        int64_t lastIteration;
+        int64_t stallBusySince;  // busySince() of the stall being tracked, 0 if none
+        int64_t lastSeenUs;
+        bool reported;
+        Stats stats;
+    };
+
+    void threadFunc();
+    void check(int64_t nowUs, std::vector<StallReport>* reports);
+    void endStall(WatchedLoop* w);
+    string sampleStack(pid_t tid);
+
+    const int64_t M_stallBudgetUs;
+    int M_sampleSignal;
+    StallCallback M_stallCallback;
+    Thread M_thread;
+    volatile bool M_running;
+    mutable MutexLock M_mutex;
+    std::vector<WatchedLoop> M_loops;  // @GuardedBy M_mutex
+};
+
+#endif
@@ -17,10 +17,13 @@ public：
     virtual ~PollPoller();
 
     virtual Timestamp poll(int timeoutMs, ChannelList* activeChannels);
+    virtual Timestamp pollPrecise(int64_t timeoutNs, ChannelList* activeChannels);
     virtual void updateChannel(Channel* channel);
     virtual void removeChannel(Channel* channel);
 
 private:
+    Timestamp collectEvents(int numEvents, int savedErrno,
+                            ChannelList* activeChannels) const;
     void fillActiveChannels(int numEvents, 
                             ChannnelList* activeChannels)  const;
 
@@ -1,9 +1,9 @@
 #ifndef PLLOER_H
 #define PLLOER_H
 
-#include <map> 
 #include <vector>
 #include <boost/noncopyable.hpp>
+#include "ChannelTable.h"
 #include "Timestamp.h"
 #include "EventLoop.h"
 
@@ -26,6 +26,10 @@ public:
     /// Must be called in the loop thread. 
     virtual Timestamp poll(int timeoutMs, ChannelList* activeChannels) = 0;
 
+    /// Like poll(), with a timeout in nanoseconds, for high resolution timers.
+    /// Must be called in the loop thread.
+    virtual Timestamp pollPrecise(int64_t timeoutNs, ChannelList* activeChannels) = 0;
+
     ///Changes the interested I/O events.  
     ///Must be called in the loop thread.  
     virtual void updateChannel(Channel* channel) = 0;
@@ -44,8 +48,7 @@ public:
     }
 
 protected:
-    typedef std::map<int, Channel*> ChannelMap;
-    ChannelMap M_channels;
+    ChannelTable M_channels;
 
 private:
     EventLoop* M_ownerLoop;
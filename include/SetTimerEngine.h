@@ -0,0 +1,35 @@
+#ifndef SETTIMERENGINE_H
+#define SETTIMERENGINE_H
+
+#include "TimerEngine.h"
+
+#include <set>
+
+///
+/// Timers in a set ordered by expiration.
+///
+class SetTimerEngine : public TimerEngine
+{
+public:
+    SetTimerEngine();
+    virtual ~SetTimerEngine();
+
+    virtual bool insert(Timer* timer);
+    virtual void cancel(Timer* timer);
+    virtual void getExpired(Timestamp now, std::vector<Timer*>* expired);
+    virtual Timestamp nextWakeup();
+
+    virtual size_t size() const
+    {
+        return M_timers.size();
+    }
+
+private:
+    typedef std::pair<Timestamp, Timer*> Entry;
+    typedef std::set<Entry> TimerList;
+
+    // Timer list sorted by expiration
+    TimerList M_timers;
+};
+
+#endif
@@ -77,6 +77,14 @@ public:
     void forceClose();
     void forceCloseWithDelay(double seconds);
     void setTcpNoDelay(bool on);
+    ///Edge-triggered I/O, handlers read and write until EAGAIN,
+    ///at most kMaxIoPerEvent syscalls each before yielding to other channels.
+    ///Must be called before connectEstablished().
+    void setEdgeTriggered(bool on);
+    ///Dispatch class of this connection in its loop, a Channel::Priority,
+    ///eg. kBulkPriority so bulk transfers don't delay latency-critical traffic.
+    ///Not thread safe, call in loop thread or before connectEstablished().
+    void setPriority(int priority);
     void startRead();
     void stopRead();
     bool isReading() const 
@@ -104,6 +112,11 @@ public:
         M_connectionCallback = cb;
     }
 
+    const ConnectionCallback& connectionCallback() const
+    {
+        return M_connectionCallback;
+    }
+
     void setMessageCallback(const MessageCallback& cb)
     {
         M_messageCallback = cb;
@@ -146,8 +159,13 @@ public:
 
 private:
     enum StateE { kDisconnected, kConnecting, kConnected, kDisconnecting };
+    static const int kMaxIoPerEvent = 16;
+
     void handleRead(Timestamp receiveTime);
+    void handleReadUntilAgain(Timestamp receiveTime);
+    void continueRead();
     void handleWrite();
+    void continueWrite();
     void handleClose();
     void handleError();
    
@@ -7,10 +7,12 @@
 
 #include <map>
 #include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 
 class Acceptor;
+class CountDownLatch;
 class EventLoop;
 class EventLoopThreadPool;
 
@@ -27,6 +29,10 @@ public:
     {
         kNoReusePort,
         kReusePort,
+        /// Every I/O loop owns an Acceptor on its own SO_REUSEPORT socket,
+        /// the kernel spreads new connections across loops, and each loop
+        /// keeps its own connection registry. No cross-thread hop per connection.
+        kReusePortPerLoop,
     };
 
     TcpServer(EventLoop* loop,
@@ -53,7 +59,7 @@ public:
 
     /// Set the number of threads for handling input.
     ///
-    /// Always accepts new connection in loop's thread.
+    /// Accepts new connection in loop's thread, unless kReusePortPerLoop.
     /// Must be called before @c start
     /// @param numThreads
     /// - 0 means all I/O in loop's thread, no thread will created.
@@ -66,6 +72,15 @@ public:
     {
         M_threadInitCallback = cb;
     }
+
+    /// Registers new connections edge-triggered with epoll.
+    /// Handlers read and write until EAGAIN or their per-event budget.
+    /// Must be called before @c start
+    void setEdgeTriggered(bool on)
+    {
+        M_edgeTriggered = on;
+    }
+
     ///valid after calling start()
     boost::shared_ptr<EventLoopThreadPool> threadPool()
     {
@@ -100,24 +115,52 @@ public:
     }
 
   private:
+    typedef std::map<string, TcpConnectionPtr> ConnectionMap;
+
+    /// Acceptor and connections of one I/O loop, for kReusePortPerLoop.
+    /// Only touched in that loop's thread.
+    struct LoopAcceptor : boost::noncopyable
+    {
+        LoopAcceptor(EventLoop* loopArg, int indexArg);
+        ~LoopAcceptor();  // out of line, Acceptor is incomplete here
+
+        EventLoop* loop;
+        const int index;
+        boost::scoped_ptr<Acceptor> acceptor;
+        ConnectionMap connections;
+        int nextConnId;
+    };
+
     /// Not thread safe, but in loop
     void newConnection(int sockfd, const InetAddress& peerAddr);
     /// Thread safe. 
     void removeConnection(const TcpConnectionPtr& conn);
     void removeConnectionInLoop(const TcpConnectionPtr& conn);
 
-    typedef std::map<string, TcpConnectionPtr> ConnectionMap;
+    /// Not thread safe, but in the I/O loop of @c la
+    void newConnectionPerLoop(LoopAcceptor* la, int sockfd, const InetAddress& peerAddr);
+    void removeConnectionPerLoop(LoopAcceptor* la, const TcpConnectionPtr& conn);
+    void destroyLoopAcceptor(LoopAcceptor* la, CountDownLatch* latch);
+
+    TcpConnectionPtr createConnection(EventLoop* ioLoop,
+                                      const string& connName,
+                                      int sockfd,
+                                      const InetAddress& peerAddr);
 
     EventLoop* M_loop;  //the acceptor loop 
+    const InetAddress M_listenAddr;
     const string M_ipPort;
     const string M_name;
-    boost::scoped_ptr<Acceptor> M_acceptor;
+    const Option M_option;
+    boost::scoped_ptr<Acceptor> M_acceptor;  //NULL if kReusePortPerLoop
+    boost::ptr_vector<LoopAcceptor> M_loopAcceptors;
     boost::shared_ptr<EventLoopThreadPool> M_threadPool;
     ConnectionCallback M_connectionCallback;
     MessageCallback M_messageCallback;
     WriteCompleteCallback M_writeCompleteCallback;
     ThreadInitCallback M_threadInitCallback;
     AtomicInt32 M_started;
+    bool M_edgeTriggered;
     //  always in loop thread 
     int M_nextConnId;
     ConnectionMap M_connections;
@@ -0,0 +1,62 @@
+#ifndef THREADPLACEMENT_H
+#define THREADPLACEMENT_H
+
+#include <vector>
+
+///
+/// Where the threads of a pool run, applied by each thread to itself.
+///
+/// Thread @c index is pinned to the CPUs of its slot and, on a NUMA machine,
+/// prefers its slot's node for memory, so what it allocates afterwards,
+/// eg. its EventLoop, buffers and pools, stays local.
+/// Topology is read from /sys, slots wrap around when threads outnumber them.
+///
+class ThreadPlacement
+{
+public:
+    enum Policy
+    {
+        kNone,             // leave it to the scheduler
+        kCpuList,          // thread i on cpus[i % cpus.size()]
+        kPerPhysicalCore,  // thread i on the hyperthreads of core i
+        kSpreadNumaNodes,  // thread i on the cpus of node i, round-robin
+    };
+
+    ThreadPlacement()
+        : M_policy(kNone)
+    {
+    }
+
+    static ThreadPlacement cpuList(const std::vector<int>& cpus);
+    static ThreadPlacement perPhysicalCore();
+    static ThreadPlacement spreadNumaNodes();
+
+    Policy policy() const
+    {
+        return M_policy;
+    }
+
+    ///
+    /// Pins the calling thread as thread @c index of its pool.
+    /// Failures are logged, the thread keeps running unpinned.
+    /// Returns true if the thread was pinned.
+    ///
+    bool apply(int index) const;
+
+    /// CPUs for thread @c index, empty for kNone.
+    std::vector<int> cpusOf(int index) const;
+
+    /// NUMA node of thread @c index, -1 if none or the machine has a single node.
+    int nodeOf(int index) const;
+
+private:
+    explicit ThreadPlacement(Policy policy)
+        : M_policy(policy)
+    {
+    }
+
+    Policy M_policy;
+    std::vector<int> M_cpus;  // kCpuList only
+};
+
+#endif
@@ -2,35 +2,102 @@
 #define THREADPOOL_H
 
 #include "Condition.h"
+#include "Histogram.h"
 #include "Mutex.h"
 #include "Thread.h"
+#include "ThreadPlacement.h"
+#include "Timestamp.h"
 #include "Types.h"
+#include "WorkStealingDeque.h"
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 
 #include <deque>
+#include <vector>
 
+///
+/// Work-stealing thread pool.
+///
+/// Each worker has a lock free deque per priority class: tasks run()
+/// from a worker go to its own, newest first, idle workers steal the
+/// oldest from the others. Tasks run() from other threads go through
+/// mutex protected injection queues, workers take a share of one at a
+/// time into their deque. Workers with nothing to do park on a condition.
+///
+/// Workers take the highest class with tasks, a lower class passed over
+/// too many times in a row while it had tasks is served next, so it
+/// doesn't starve. A task past its deadline when taken doesn't run.
+///
+/// tryRun() never blocks, it rejects a task when the injection queues
+/// are full or, optionally, when the pool is overloaded, so overload
+/// shows up as fast errors in the caller, eg. an EventLoop.
+///
 class ThreadPool : boost::noncopyable
 {
 public:
     typedef boost::function<void ()> Task;
 
+    enum Priority
+    {
+        kHighPriority,     // latency-critical requests
+        kNormalPriority,   // the default
+        kLowPriority,      // batch jobs
+        kNumPriorities
+    };
+
+    enum Admission
+    {
+        kAdmitted,
+        kQueueFull,    // maxQueueSize reached
+        kOverloaded    // the oldest queued task waited longer than maxQueueDelay
+    };
+
     explicit ThreadPool(const string& nameArg = string("ThreadPool"));
     ~ThreadPool();
 
     //Must be called before start().
+    //Bounds the injection queues, workers never block in run().
     void setMaxQueueSize(int maxSize)
     {
-        M_maxQueueSize = maxsize;
+        M_maxQueueSize = maxSize;
     }    
 
+    /// Must be called before start(). tryRun() rejects tasks while a task
+    /// of their class or a higher one has been queued longer than
+    /// @c seconds, 0.0 (the default) for no limit.
+    void setMaxQueueDelay(double seconds)
+    {
+        M_maxQueueDelay = static_cast<int64_t>(seconds * Timestamp::kMicroSecondsPerSecond);
+    }
+
+    ///
+    /// Must be called before start(). CoDel shedding, off by default:
+    /// once tasks leaving the injection queues have waited longer than
+    /// @c target for a whole @c interval, tasks from tryRun() are dropped
+    /// as they leave, at a rate that grows with the square root of the drops
+    /// until the wait is under @c target again. A dropped task's missed
+    /// task runs instead, so stale work fails fast rather than running late.
+    /// eg. setCoDel(0.005, 0.1)
+    ///
+    void setCoDel(double target, double interval)
+    {
+        M_codelTarget = static_cast<int64_t>(target * Timestamp::kMicroSecondsPerSecond);
+        M_codelInterval = static_cast<int64_t>(interval * Timestamp::kMicroSecondsPerSecond);
+    }
+
     void setThreadInitCallback(const Task& cb)
     {
         M_threadInitCallback = cb;
     }
 
+    /// Pins worker threads, see ThreadPlacement. Must be called before start().
+    void setPlacement(const ThreadPlacement& placement)
+    {
+        M_placement = placement;
+    }
+
     void start(int numThreads);
     void stop();
 
@@ -39,25 +106,141 @@ public:
         return M_name;
     }
 
+    /// Tasks queued, not yet taken by a worker. Approximate.
     size_t queueSize() const;
 
-    // Could block if maxQueueSize > 0
+    // Could block if maxQueueSize > 0, when called from outside the pool
     void run(const Task& f);
 
+    ///
+    /// Runs @c f as a task of class @c priority. If it hasn't started
+    /// @c timeout seconds from now, 0.0 for no deadline, it is dropped
+    /// and @c missed, if any, runs instead.
+    /// Could block if maxQueueSize > 0, when called from outside the pool.
+    ///
+    void run(const Task& f, Priority priority,
+             double timeout = 0.0, const Task& missed = Task());
+
+    ///
+    /// run() that never blocks. Returns kQueueFull or kOverloaded
+    /// without queueing @c f if the pool can't take it now. From a worker
+    /// with room in its deque it always admits, that work continues a
+    /// task already admitted. Unlike run(), it never runs @c f in the
+    /// caller: a pool without threads returns kQueueFull.
+    ///
+    Admission tryRun(const Task& f, Priority priority = kNormalPriority,
+                     double timeout = 0.0, const Task& missed = Task());
+
+    /// Queues all @c tasks with one lock, or none from a worker with room
+    /// in its deque, and wakes as many parked workers as there are tasks.
+    /// Could block if maxQueueSize > 0, when called from outside the pool.
+    void runBatch(const std::vector<Task>& tasks, Priority priority = kNormalPriority);
+
+    /// Microseconds from run() until taken by a worker, tasks of class
+    /// @c priority, missed ones included. Thread safe.
+    Histogram::Snapshot queueWait(Priority priority) const;
+
+    /// Tasks dropped for missing their deadline. Thread safe.
+    int64_t missedDeadlines() const
+    {
+        return __atomic_load_n(&M_missedDeadlines, __ATOMIC_RELAXED);
+    }
+
+    /// Tasks tryRun() didn't admit. Thread safe.
+    int64_t rejected() const
+    {
+        return __atomic_load_n(&M_rejected, __ATOMIC_RELAXED);
+    }
+
+    /// Admitted tasks dropped by CoDel. Thread safe.
+    int64_t shedTasks() const
+    {
+        return __atomic_load_n(&M_shedTasks, __ATOMIC_RELAXED);
+    }
+
 private:
+    // most tasks a worker moves from an injection queue at a time
+    static const size_t kMaxTakeBatch = 32;
+
+    struct QueuedTask
+    {
+        Task task;
+        Task missed;
+        int64_t enqueueTime;  // FastClock::monotonicNow(), in microseconds
+        int64_t deadline;     // same clock, 0 for none
+        bool sheddable;       // from tryRun(), CoDel may drop it
+        bool shed;            // dropped by CoDel, runs missed instead
+    };
+
+    struct Worker : boost::noncopyable
+    {
+        explicit Worker(int index)
+            : seed(static_cast<uint32_t>(index) * 2654435761u + 1)
+        {
+            for(int p = 0; p < kNumPriorities; ++p)
+            {
+                passes[p] = 0;
+            }
+        }
+
+        WorkStealingDeque<QueuedTask> deques[kNumPriorities];
+        int passes[kNumPriorities];           // taken a higher class while tasks of it were waiting
+        Histogram queueWait[kNumPriorities];  // written by this worker only
+        uint32_t seed;  // victim selection
+    };
+
     bool isFull() const;
-    void runInThread();
-    Task take();
+    bool running() const
+    {
+        return __atomic_load_n(&M_running, __ATOMIC_ACQUIRE);
+    }
+    int64_t pending(int priority) const
+    {
+        return __atomic_load_n(&M_pending[priority], __ATOMIC_SEQ_CST);
+    }
+    int64_t totalPending() const;
+    QueuedTask* newTask(const Task& task, const Task& missed, int64_t now, double timeout);
+    void enqueue(QueuedTask* task, int priority);
+    void inject(QueuedTask* task, int priority);
+    void published(int priority, size_t numTasks);
+    int64_t oldestWait(int priority, int64_t now) const;
+    void codelCheck(QueuedTask* task, int64_t now, bool emptied);
+    void runInThread(int index);
+    void runTask(Worker* self, int priority, const QueuedTask& task);
+    QueuedTask* take(int index, int* priority);
+    QueuedTask* takeNext(int index, int* priority);
+    QueuedTask* takeClass(int index, int priority);
+    QueuedTask* takeInjected(Worker* self, int priority);
+    QueuedTask* steal(int index, int priority);
+    void notifyIdle(size_t numTasks);
+    void discardQueued();
 
     mutable MutexLock M_mutex;
-    Condition M_notEmpty;
+    Condition M_notEmpty;  // parked workers
     Condition M_notFull;
     string M_name;
     Task M_threadInitCallback;
+    ThreadPlacement M_placement;
     boost::ptr_vector<Thread> M_threads;
-    std::deque<Task> M_queue;
+    boost::ptr_vector<Worker> M_workers;
+    std::deque<QueuedTask*> M_queues[kNumPriorities];  // @GuardedBy M_mutex, injection queues
+    size_t M_queued;     // @GuardedBy M_mutex, in all injection queues
     size_t M_maxQueueSize;
-    bool M_running;
+    int64_t M_maxQueueDelay;  // microseconds, 0 for none
+    int64_t M_codelTarget;    // microseconds, 0 for off
+    int64_t M_codelInterval;
+    int64_t M_codelFirstAbove;  // @GuardedBy M_mutex, when waits over target start to count, 0 if under
+    int64_t M_codelDropNext;    // @GuardedBy M_mutex
+    uint32_t M_codelCount;      // @GuardedBy M_mutex, drops since dropping started
+    uint32_t M_codelLastCount;  // @GuardedBy M_mutex
+    bool M_codelDropping;       // @GuardedBy M_mutex
+    bool M_running;      // atomic
+    size_t M_injected[kNumPriorities];  // atomic, M_queues[p].size() to peek without the lock
+    int64_t M_pending[kNumPriorities];  // atomic, queued anywhere, may dip below 0 briefly
+    int M_sleepers;      // atomic, workers parked or about to
+    int64_t M_missedDeadlines;  // atomic
+    int64_t M_rejected;         // atomic
+    int64_t M_shedTasks;        // atomic
 };
 
-#endif
\ No newline at end of file
+#endif
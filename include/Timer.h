@@ -4,23 +4,42 @@
 
 #include <boost/noncopyable.hpp>
 
-#include "Atomic.h"
 #include "Timestamp.h"
 #include "Callbacks.h"
 
+///
+/// A timer slot of a TimerQueue's pool, reused for one timer after another.
+///
+/// The generation changes each time the slot is retired, a TimerId holds
+/// the slot and its generation, so a stale one never matches a later timer.
+///
 class Timer : boost::noncopyable
 {
 public:
-    Timer(const TimerCallback &cb, Timestamp when, double interval)
-        : M_callback(cb),
-          M_expiration(when),
-          M_interval(interval),
-          M_repeat(interval > 0.0)
-          M_sequence(s_numCreated.incrementAndGet())
+    Timer()
+        : M_interval(0.0),
+          M_slack(0),
+          M_repeat(false),
+          M_precise(false),
+          M_generation(0),
+          M_canceled(false),
+          M_prev(NULL),
+          M_next(NULL),
+          M_index(-1)
     {   
 
     }
 
+    /// Starts a timer in a retired slot, from any thread holding the slot.
+    /// It may run up to @c slack seconds after @c when, a @c precise one
+    /// is a high resolution timer, driven by poll timeouts.
+    void reuse(const TimerCallback& cb, Timestamp when, double interval,
+               double slack, bool precise);
+
+    /// Drops the callback and moves to the next generation.
+    /// Must be called in the loop thread.
+    void retire();
+
     void run() const
     {
         M_callback();
@@ -31,34 +50,66 @@ public:
         return M_expiration;
     }
 
+    /// Latest time the timer should run, expiration() plus its slack.
+    Timestamp deadline() const 
+    {
+        return Timestamp(M_expiration.microSecondsSinceEpoch() + M_slack);
+    }
+
     bool repeat() const 
     {
         return M_repeat;
     }
 
-    int64_t sequence() const 
+    bool precise() const 
+    {
+        return M_precise;
+    }
+
+    /// Safe to read from the loop thread while another thread reuses the slot.
+    int64_t generation() const 
     {
-        return M_sequence;
+        return __atomic_load_n(&M_generation, __ATOMIC_RELAXED);
     }
 
     void restart(Timestamp now);
 
-    static int64_t numCreated()
+    /// Canceled while not pending, eg. from its own callback: don't repeat.
+    void cancel()
     {
-        return s_numCreated.get();
+        M_canceled = true;
     }
 
+    bool canceled() const 
+    {
+        return M_canceled;
+    }
 
-private:
-    const TimerCallback M_callback;
-    Timestamp M_expiration;
-    const double M_interval;
-    const bool M_repeat;
-    const int64_t M_sequence;
-    
-    static AtomicInt64 s_numCreated;
+    /// Held by a TimerEngine.
+    bool pending() const 
+    {
+        return M_index >= 0;
+    }
 
+private:
+    friend class HeapTimerEngine;
+    friend class SetTimerEngine;
+    friend class WheelTimerEngine;
+
+    TimerCallback M_callback;
+    Timestamp M_expiration;  // on CLOCK_MONOTONIC
+    double M_interval;
+    int64_t M_slack;  // in microseconds
+    bool M_repeat;
+    bool M_precise;
+    int64_t M_generation;  // atomic
+    bool M_canceled;
+
+    // intrusive links, for the TimerEngine holding the timer
+    Timer* M_prev;
+    Timer* M_next;
+    int M_index;  // wheel bucket, heap position or 0 in the set, -1 if not pending
 };
 
 
-#endif
\ No newline at end of file
+#endif
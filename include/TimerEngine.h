@@ -0,0 +1,53 @@
+#ifndef TIMERENGINE_H
+#define TIMERENGINE_H
+
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "Timestamp.h"
+
+class Timer;
+
+///
+/// Base class for the pending timers of a TimerQueue.
+///
+/// Holds Timers of the TimerQueue's pool, doesn't own them.
+/// A Timer is pending() exactly while an engine holds it.
+/// Must be used in the loop thread.
+///
+class TimerEngine : boost::noncopyable
+{
+public:
+    enum Kind
+    {
+        kSetEngine,    // ordered sets, exact, O(log n)
+        kWheelEngine,  // hierarchical timing wheel, O(1), tick resolution
+        kHeapEngine,   // 4-ary heap indexed from the Timers, exact, O(log n)
+    };
+
+    virtual ~TimerEngine();
+
+    /// Adds @c timer, returns true if the wakeup has to move earlier.
+    virtual bool insert(Timer* timer) = 0;
+
+    /// Takes @c timer out, it must be pending().
+    virtual void cancel(Timer* timer) = 0;
+
+    /// Takes out the timers due at @c now.
+    virtual void getExpired(Timestamp now, std::vector<Timer*>* expired) = 0;
+
+    /// When the timerfd should fire next, invalid if nothing is pending.
+    virtual Timestamp nextWakeup() = 0;
+
+    virtual size_t size() const = 0;
+
+    /// @c tickSeconds is the resolution of kWheelEngine.
+    static TimerEngine* newTimerEngine(Kind kind, double tickSeconds);
+
+    /// kWheelEngine if MUDUO_USE_TIMER_WHEEL is set,
+    /// kHeapEngine if MUDUO_USE_TIMER_HEAP is set, else kSetEngine.
+    static TimerEngine* newDefaultTimerEngine();
+};
+
+#endif
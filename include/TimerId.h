@@ -6,20 +6,22 @@ class Timer;
 ///
 /// An opaque identifier,for canceling Timer.  
 ///
+/// The Timer slot and its generation, harmless once the timer is gone.
+///
 
 class TimerId 
 {
 public:
     TimerId()
       : M_timer(NULL),
-        M_sequence(0)
+        M_generation(0)
     {
 
     }
 
-    TimerId(Timer* timer, int64_t seq)
+    TimerId(Timer* timer, int64_t generation)
       : M_timer(timer),
-        M_sequence(seq)
+        M_generation(generation)
     {
         
     }
@@ -28,7 +30,7 @@ public:
 
 private:
     Timer* M_timer;
-    int64_t M_sequence;    
+    int64_t M_generation;    
         
 };
 
@@ -5,13 +5,17 @@
 #include <vector>
 
 #include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "Mutex.h"
 #include "Timestamp.h"
 #include "Callbacks.h"
 #include "Channel.h"
+#include "TimerEngine.h"
+#include "TimerSpec.h"
 
 class EventLoop;
+class Histogram;
 class Timer;
 class TimerId;
 
@@ -19,6 +23,29 @@ class TimerId;
 /// A best efforts timer queue
 /// No guarantee that the callback will be on time. 
 ///
+/// Expirations are on CLOCK_MONOTONIC, see FastClock::monotonicNow(),
+/// and the timerfd is set to them as absolute times.
+///
+/// Timers with slack share wakeups: the timerfd is only reprogrammed
+/// when a new timer's deadline, expiration plus slack, comes before
+/// the armed wakeup.
+///
+/// In poll driven mode there is no timerfd: the loop polls with a
+/// timeout up to pollWakeup() and calls runExpiredTimers() after
+/// dispatching I/O, saving a read(2) per expiry and a timerfd_settime()
+/// per reschedule. The default is set by env MUDUO_POLL_DRIVEN_TIMERS.
+///
+/// High resolution timers are kept apart, the loop polls with a
+/// nanosecond timeout for preciseWakeup() and calls runPreciseTimers().
+///
+/// Timers added or canceled from other threads are handed over in
+/// batches: they queue under a mutex and the loop takes them all with
+/// one pending functor.
+///
+/// Timers come from slabs owned by the queue and are recycled, never freed
+/// while it lives, so a stale TimerId still points to a Timer and is told
+/// apart by generation.
+///
 
 class TimerQueue : boost::noncopyable
 {
@@ -27,44 +54,139 @@ public:
     ~TimerQueue();
 
     ///
-    /// Schedules the callback to be run at given time,
-    /// repeats if @c interval > 0.0. 
+    /// Schedules the callback to be run at given monotonic time,
+    /// repeats if @c interval > 0.0. It may run up to
+    /// @c slack seconds late, sharing a wakeup with other timers.
     ///
     /// Must be thread safe. Usually be called from other threads.  
     TimerId addTimer(const TimerCallback& cb,
-                     Timerstamp when,
-                     double interval);
+                     Timestamp when,
+                     double interval,
+                     double slack = 0.0);
+
+    ///
+    /// Schedules a high resolution timer at given monotonic time,
+    /// repeats if @c interval > 0.0. Thread safe.
+    ///
+    TimerId addPreciseTimer(const TimerCallback& cb,
+                            Timestamp when,
+                            double interval);
 
     void cancel(TimerId timerId);  
 
-private:
+    ///
+    /// Schedules a batch, inserted together with at most one
+    /// timerfd reprogram. @c offsetUs is added to each TimerSpec::when
+    /// to make it monotonic. Appends their ids to @c timerIds in order.
+    /// Thread safe.
+    ///
+    void addTimers(const std::vector<TimerSpec>& timers,
+                   int64_t offsetUs,
+                   std::vector<TimerId>* timerIds);
+
+    /// Cancels a batch. Thread safe.
+    void cancel(const std::vector<TimerId>& timerIds);
+
+    ///
+    /// Replaces the engine holding pending timers, takes ownership.
+    /// Must be called in the loop thread while no timer is pending.
+    ///
+    void setEngine(TimerEngine* engine);
 
-    // FIXME : use unique_ptr<Timer> instead of raw pointers. 
-    typedef std::pair<Timestamp, Timer*> Entry;
-    typedef std::set<Entry> TimerList;
-    typedef std::pair<Timer*, int64_t> ActiveTimer;
-    typedef std::set<ActiveTimer> ActiveTimerSet;
+    bool pollDriven() const 
+    {
+        return !M_timerfdChannel;
+    }
 
+    ///
+    /// Switches between a timerfd and poll driven mode.
+    /// Must be called in the loop thread, not from a timer callback.
+    ///
+    void setPollDriven(bool on);
+
+    /// When the loop should wake up for timers in poll driven mode,
+    /// invalid if none or in timerfd mode. Must be called in the loop thread.
+    Timestamp pollWakeup() const 
+    {
+        return pollDriven() ? M_armed : Timestamp::invalid();
+    }
+
+    /// Runs the timers expired by loop time, in poll driven mode.
+    /// Must be called in the loop thread.
+    void runExpiredTimers();
+
+    /// Earliest expiration of the high resolution timers, invalid if none.
+    /// Must be called in the loop thread.
+    Timestamp preciseWakeup()
+    {
+        return M_preciseEngine->nextWakeup();
+    }
+
+    /// Runs the high resolution timers expired at @c now.
+    /// Must be called in the loop thread.
+    void runPreciseTimers(Timestamp now);
+
+    /// Where to record how late timers run, in microseconds, by class.
+    /// Either may be NULL. Must be called in the loop thread.
+    void setLatenessHistograms(Histogram* lateness, Histogram* preciseLateness);
+
+    /// timerfd_settime() calls made. Safe to read from other threads.
+    int64_t reprograms() const 
+    {
+        return __atomic_load_n(&M_reprograms, __ATOMIC_RELAXED);
+    }
+
+    /// Timers added ahead of the earliest one that were left to the
+    /// armed wakeup instead of reprogramming. Safe to read from other threads.
+    int64_t reprogramsSaved() const 
+    {
+        return __atomic_load_n(&M_reprogramsSaved, __ATOMIC_RELAXED);
+    }
+
+private:
+
+    TimerId schedule(Timer* timer);
     void addTimerInLoop(Timer * timer);
     void cancelInLoop(TimerId timerId);
+    void insert(Timer* timer, Timestamp* deadline);
+    void rearm(Timestamp deadline);
+    void queuePending(Timer* const* timers, size_t numTimers,
+                      const TimerId* timerIds, size_t numTimerIds);
+    void doPendingTimers();
+    void openTimerfd();
+    void closeTimerfd();
     // called when timerfd alarms
     void handleRead();
-    // move out all expired timers 
-    std::vector<Entry> getExpired(Timestamp now);
-    void reset(const std::vector<Entry>& expired, Timestamp now);
-
-    bool insert(Timer* timer);
+    void expire(Timestamp now);
+    void runTimers(const std::vector<Timer*>& expired, Timestamp now, Histogram* lateness);
+    void reset(const std::vector<Timer*>& expired, Timestamp now);
+    void arm(Timestamp when);
+    Timer* allocateTimer();
+    void allocateTimers(size_t n, std::vector<Timer*>* timers);
+    void recycle(Timer* timer);
 
     EventLoop* M_loop;
-    const int M_timerfd;
-    Channel M_timerfdChannel;
-    // Timer list sorted by expiration
-    TimerList M_timers;
-
-    // for cancel()
-    ActiveTimerSet M_activeTimers;
-    bool M_callingExpiredTimers;  /*atomic*/
-    ActiveTimerSet M_cancelingTimers;
+    int M_timerfd;                               // -1 if poll driven
+    boost::scoped_ptr<Channel> M_timerfdChannel; // NULL if poll driven
+    boost::scoped_ptr<TimerEngine> M_engine;
+    boost::scoped_ptr<TimerEngine> M_preciseEngine;  // high resolution timers
+    std::multiset<Timestamp> M_deadlines;  // of the timers in M_engine, engines order by expiration
+    Histogram* M_lateness;
+    Histogram* M_preciseLateness;
+    Timestamp M_armed;           // absolute wakeup the timerfd or poll is set to, invalid if none
+    int64_t M_reprograms;        // atomic
+    int64_t M_reprogramsSaved;   // atomic
+
+    static const size_t kTimersPerSlab = 256;
+
+    std::vector<Timer*> M_freeTimers;  // loop thread only
+    MutexLock M_poolMutex;
+    std::vector<Timer*> M_sharedFreeTimers;  // @GuardedBy M_poolMutex, for other threads
+    std::vector<Timer*> M_slabs;             // @GuardedBy M_poolMutex, arrays of kTimersPerSlab
+
+    MutexLock M_pendingMutex;
+    std::vector<Timer*> M_pendingAdds;       // @GuardedBy M_pendingMutex
+    std::vector<TimerId> M_pendingCancels;   // @GuardedBy M_pendingMutex
 };
 
 
@@ -0,0 +1,28 @@
+#ifndef TIMERSPEC_H
+#define TIMERSPEC_H
+
+#include "Timestamp.h"
+#include "Callbacks.h"
+
+///
+/// One timer of a batch for EventLoop::addTimers(),
+/// the arguments of EventLoop::runAt() plus its repeat interval.
+///
+struct TimerSpec
+{
+    TimerSpec(const TimerCallback& cb, Timestamp whenArg,
+              double intervalArg = 0.0, double slackArg = 0.0)
+        : callback(cb),
+          when(whenArg),
+          interval(intervalArg),
+          slack(slackArg)
+    {
+    }
+
+    TimerCallback callback;
+    Timestamp when;   // wall clock, as for runAt()
+    double interval;  // repeats if > 0.0
+    double slack;     // may run this many seconds late
+};
+
+#endif
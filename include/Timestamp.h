@@ -1,3 +1,6 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
 #include "Types.h"
 
 #include <boost/operators.hpp>
@@ -101,4 +104,6 @@ inline Timestamp addTime(Timestamp timestamp, double seconds)
 {
     int64_t delta = static_cast<int64_t>(seconds * Timestamp::kMicroSecondsPerSecond);
     return Timestamp(timestamp.microSecondsSinceEpoch() + delta);
-}
\ No newline at end of file
+}
+
+#endif
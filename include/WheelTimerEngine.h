@@ -0,0 +1,53 @@
+#ifndef WHEELTIMERENGINE_H
+#define WHEELTIMERENGINE_H
+
+#include "TimerEngine.h"
+
+///
+/// Hierarchical timing wheel, 4 levels of 256 slots.
+///
+/// Expirations are rounded up to the tick, so timers never fire early.
+/// Add, cancel and expire are O(1), timers are linked into slots through
+/// their intrusive links. Timers beyond 2^32 ticks wait in the top level
+/// and are placed again when it turns.
+///
+class WheelTimerEngine : public TimerEngine
+{
+public:
+    explicit WheelTimerEngine(double tickSeconds);
+    virtual ~WheelTimerEngine();
+
+    virtual bool insert(Timer* timer);
+    virtual void cancel(Timer* timer);
+    virtual void getExpired(Timestamp now, std::vector<Timer*>* expired);
+    virtual Timestamp nextWakeup();
+
+    virtual size_t size() const
+    {
+        return M_size;
+    }
+
+private:
+    static const int kLevelBits = 8;
+    static const int kSlotsPerLevel = 1 << kLevelBits;
+    static const int kSlotMask = kSlotsPerLevel - 1;
+    static const int kNumLevels = 4;
+    static const int kDueBucket = kNumLevels * kSlotsPerLevel;  // already due
+
+    int64_t tickOf(Timestamp when) const;
+    void place(Timer* timer);
+    void link(Timer* timer, int bucket);
+    void unlink(Timer* timer);
+    void cascade(int level);
+    void drain(int bucket, std::vector<Timer*>* expired);
+    int64_t nextBoundary() const;
+
+    const int64_t M_tickUs;
+    int64_t M_currentTick;  // timers up to this tick have expired
+    int64_t M_armedTick;    // last reported by nextWakeup()
+    Timer* M_buckets[kDueBucket + 1];
+    int M_levelCount[kNumLevels];
+    size_t M_size;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef WORKSTEALINGDEQUE_H
+#define WORKSTEALINGDEQUE_H
+
+#include <boost/noncopyable.hpp>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+///
+/// Chase-Lev work-stealing deque of pointers, fixed capacity.
+///
+/// The owner thread pushes and pops at the bottom, any thread steals
+/// from the top. Lock free, one CAS per steal and per pop of the last
+/// element. push() fails when full, the caller keeps the element elsewhere.
+///
+/// After "Correct and Efficient Work-Stealing for Weak Memory Models",
+/// Le, Pop, Cohen and Zappa Nardelli, PPoPP 2013.
+///
+template<typename T>
+class WorkStealingDeque : boost::noncopyable
+{
+public:
+    /// @c capacity must be a power of 2.
+    explicit WorkStealingDeque(size_t capacity = 4096)
+        : M_top(0),
+          M_bottom(0),
+          M_mask(static_cast<int64_t>(capacity) - 1),
+          M_buffer(new T*[capacity])
+    {
+        assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    }
+
+    ~WorkStealingDeque()
+    {
+        delete[] M_buffer;
+    }
+
+    /// Owner thread only. Returns false if full.
+    bool push(T* x)
+    {
+        int64_t b = __atomic_load_n(&M_bottom, __ATOMIC_RELAXED);
+        int64_t t = __atomic_load_n(&M_top, __ATOMIC_ACQUIRE);
+        if(b - t > M_mask)
+        {
+            return false;
+        }
+        __atomic_store_n(&M_buffer[b & M_mask], x, __ATOMIC_RELAXED);
+        // publishes *x to thieves, who load the bottom with acquire
+        __atomic_store_n(&M_bottom, b + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    /// Owner thread only, newest first. Returns NULL if empty.
+    T* pop()
+    {
+        int64_t b = __atomic_load_n(&M_bottom, __ATOMIC_RELAXED) - 1;
+        __atomic_store_n(&M_bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int64_t t = __atomic_load_n(&M_top, __ATOMIC_RELAXED);
+        T* x = NULL;
+        if(t <= b)
+        {
+            x = __atomic_load_n(&M_buffer[b & M_mask], __ATOMIC_RELAXED);
+            if(t == b)
+            {
+                // the last one, race the thieves for it
+                if(!__atomic_compare_exchange_n(&M_top, &t, t + 1, false,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                {
+                    x = NULL;
+                }
+                __atomic_store_n(&M_bottom, b + 1, __ATOMIC_RELAXED);
+            }
+        }
+        else
+        {
+            __atomic_store_n(&M_bottom, b + 1, __ATOMIC_RELAXED);
+        }
+        return x;
+    }
+
+    /// Any thread, oldest first. Returns NULL if empty or lost a race.
+    T* steal()
+    {
+        int64_t t = __atomic_load_n(&M_top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int64_t b = __atomic_load_n(&M_bottom, __ATOMIC_ACQUIRE);
+        if(t >= b)
+        {
+            return NULL;
+        }
+        T* x = __atomic_load_n(&M_buffer[t & M_mask], __ATOMIC_RELAXED);
+        if(!__atomic_compare_exchange_n(&M_top, &t, t + 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            return NULL;
+        }
+        return x;
+    }
+
+    /// Approximate from threads other than the owner.
+    size_t size() const
+    {
+        int64_t b = __atomic_load_n(&M_bottom, __ATOMIC_RELAXED);
+        int64_t t = __atomic_load_n(&M_top, __ATOMIC_RELAXED);
+        return b > t ? static_cast<size_t>(b - t) : 0;
+    }
+
+private:
+    // apart, thieves hammer the top while the owner works the bottom
+    int64_t M_top;
+    char M_pad[64 - sizeof(int64_t)];
+    int64_t M_bottom;
+    const int64_t M_mask;
+    T** M_buffer;
+};
+
+#endif
@@ -23,6 +23,7 @@ Acceptor::Acceptor(EventLoop* loop, const InetAddress& listenAdddr, bool reusepo
     M_acceptSocket.bindAddress(listenAddr);
     M_acceptChannel.setReadCallback(
         boost::bind(&Acceptor::handleRead,this));
+    M_acceptChannel.setPriority(Channel::kControlPriority);
 }
 
 Acceptor::~Acceptor()
@@ -43,32 +44,44 @@ void Acceptor::listen()
 void Acceptor::handleRead()
 {
     M_loop->assertInLoopThread();
-    InetAddrss peerAddr;
-    //FIXME loop until no more 
-    int connfd = M_acceptSocket.accept(&peerAddr);
-    if(connfd >= 0)
+    // Drains the accept backlog, so a burst of connections costs one
+    // readiness event instead of one poll round trip per connection.
+    // Bounded by kMaxAcceptsPerRead to keep other channels of this loop fair,
+    // the listening fd is level-triggered, so leftovers are reported again.
+    for(int i = 0; i < kMaxAcceptsPerRead; ++i)
     {
-        if(M_newConnectionCallback)
+        InetAddress peerAddr;
+        int connfd = M_acceptSocket.accept(&peerAddr);
+        if(connfd >= 0)
         {
-            newConnectionCallback(connfd, peerAddr);
+            if(M_newConnectionCallback)
+            {
+                M_newConnectionCallback(connfd, peerAddr);
+            }
+            else
+            {
+                sockets::close(connfd);
+            }
         }
         else
         {
-            sockets::close(connfd);
+            int savedErrno = errno;
+            if(savedErrno == EAGAIN || savedErrno == EWOULDBLOCK)
+            {
+                break;
+            }
+            LOG_SYSERR << "in Acceptor::handleRead";
+            // Read the section named "The special problem of
+            // accept()ing when you can't" in libev's doc.
+            // By Marc Lehmann, author of libev.
+            if (savedErrno == EMFILE)
+            {
+                ::close(M_idleFd);
+                M_idleFd = ::accept(M_acceptSocket.fd(), NULL, NULL);
+                ::close(M_idleFd);
+                M_idleFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+            break;
         }
     }
-    else
-    {
-        LOG_SYSERR << "in Acceptor::handleRead";
-        // Read the section named "The special problem of
-        // accept()ing when you can't" in libev's doc.
-        // By Marc Lehmann, author of libev.
-        if (errno == EMFILE)
-        {
-            ::close(M_idleFd);
-            M_idleFd = ::accept(M_acceptSocket.fd(), NULL, NULL);
-            ::close(M_idleFd);
-            M_idleFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
-        }
-    }
-}    
\ No newline at end of file
+}
@@ -17,6 +17,8 @@ Channel::Channel(EventLoop* loop, int fd)
       M_revents(0),
       M_index(-1),
       M_logHup(true),
+      M_edgeTriggered(false),
+      M_priority(kLatencyPriority),
       M_tied(false),
       M_eventHandling(false),
       M_addedToLoop(false)
@@ -0,0 +1,304 @@
+#include "Coroutine.h"
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include "Logging.h"
+#include "Exception.h"
+#include "TcpClient.h"
+#include "TcpServer.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace
+{
+    const size_t kFrameGranularity = 64;
+    const size_t kNumFrameClasses = 64;         // frames up to 4KiB are pooled
+    const size_t kMaxPooledBytes = 256 * 1024;  // per thread
+
+    struct FreeFrame
+    {
+        FreeFrame* next;
+    };
+
+    size_t frameClassOf(size_t size)
+    {
+        return (size + kFrameGranularity - 1) / kFrameGranularity;
+    }
+
+    /// Free frames of one thread. A frame freed on another loop than the
+    /// one that allocated it lands here too, the byte cap keeps a thread
+    /// that mostly frees from hoarding them.
+    class FramePool : boost::noncopyable
+    {
+    public:
+        FramePool()
+            : M_pooledBytes(0)
+        {
+            std::fill(M_freeFrames, M_freeFrames + kNumFrameClasses, static_cast<FreeFrame*>(NULL));
+        }
+
+        ~FramePool()
+        {
+            for(size_t cls = 0; cls < kNumFrameClasses; ++cls)
+            {
+                while(FreeFrame* frame = M_freeFrames[cls])
+                {
+                    M_freeFrames[cls] = frame->next;
+                    ::operator delete(frame);
+                }
+            }
+        }
+
+        void* allocate(size_t cls)
+        {
+            FreeFrame* frame = M_freeFrames[cls];
+            if(frame)
+            {
+                M_freeFrames[cls] = frame->next;
+                M_pooledBytes -= cls * kFrameGranularity;
+                return frame;
+            }
+            return ::operator new(cls * kFrameGranularity);
+        }
+
+        void deallocate(void* p, size_t cls)
+        {
+            if(M_pooledBytes + cls * kFrameGranularity > kMaxPooledBytes)
+            {
+                ::operator delete(p);
+                return;
+            }
+            FreeFrame* frame = static_cast<FreeFrame*>(p);
+            frame->next = M_freeFrames[cls];
+            M_freeFrames[cls] = frame;
+            M_pooledBytes += cls * kFrameGranularity;
+        }
+
+    private:
+        FreeFrame* M_freeFrames[kNumFrameClasses];
+        size_t M_pooledBytes;
+    };
+
+    // not __thread, the pool is freed when its thread exits
+    thread_local FramePool t_framePool;
+
+    void ignoreMessage(const TcpConnectionPtr&, Buffer*, Timestamp)
+    {
+        // keep the data for the next co_await read
+    }
+}
+
+void* detail::allocateFrame(size_t size)
+{
+    size_t cls = frameClassOf(size);
+    if(cls >= kNumFrameClasses)
+    {
+        return ::operator new(size);
+    }
+    return t_framePool.allocate(cls);
+}
+
+void detail::deallocateFrame(void* p, size_t size)
+{
+    size_t cls = frameClassOf(size);
+    if(cls >= kNumFrameClasses)
+    {
+        ::operator delete(p);
+        return;
+    }
+    t_framePool.deallocate(p, cls);
+}
+
+void detail::abortOnException()
+{
+    try
+    {
+        throw;
+    }
+    catch(const Exception& ex)
+    {
+        fprintf(stderr, "exception caught in coroutine\n");
+        fprintf(stderr, "reason: %s\n", ex.what());
+        fprintf(stderr, "stack trace: %s\n", ex.stackTrace());
+    }
+    catch(const std::exception& ex)
+    {
+        fprintf(stderr, "exception caught in coroutine\n");
+        fprintf(stderr, "reason: %s\n", ex.what());
+    }
+    catch(...)
+    {
+        fprintf(stderr, "unknown exception caught in coroutine\n");
+    }
+    abort();
+}
+
+CoConnection::CoConnection(const TcpConnectionPtr& conn)
+    : M_conn(conn),
+      M_state(new State)
+{
+    conn->getLoop()->assertInLoopThread();
+    M_state->closed = !conn->connected();
+    M_state->previous = conn->connectionCallback();
+    StatePtr state = M_state;
+    conn->setMessageCallback(
+        [state](const TcpConnectionPtr& c, Buffer* buf, Timestamp) { onMessage(state, c, buf); });
+    conn->setWriteCompleteCallback(
+        [state](const TcpConnectionPtr& c) { onWriteComplete(state, c); });
+    conn->setConnectionCallback(
+        [state](const TcpConnectionPtr& c) { onConnection(state, c); });
+}
+
+void CoConnection::onMessage(const StatePtr& state, const TcpConnectionPtr&, Buffer* buf)
+{
+    if(state->waiter && (state->op == State::kRead || state->op == State::kReadUntil)
+        && state->ready(buf) > 0)
+    {
+        state->resume();
+    }
+}
+
+void CoConnection::onWriteComplete(const StatePtr& state, const TcpConnectionPtr& conn)
+{
+    // write complete is queued, it may belong to an earlier write that didn't suspend
+    if(state->waiter && state->op == State::kWrite
+        && conn->outputBuffer()->readableBytes() == 0)
+    {
+        state->resume();
+    }
+}
+
+void CoConnection::onConnection(const StatePtr& state, const TcpConnectionPtr& conn)
+{
+    if(!conn->connected())
+    {
+        state->closed = true;
+        if(state->waiter)
+        {
+            state->resume();
+        }
+    }
+    if(state->previous)
+    {
+        state->previous(conn);
+    }
+}
+
+void ConnectAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    boost::shared_ptr<State> state = M_state;
+    TcpClient* client = M_client;
+    client->setMessageCallback(ignoreMessage);
+    client->setConnectionCallback(
+        [state, client, handle](const TcpConnectionPtr& conn)
+        {
+            // only the first connection resumes, later reconnects are the CoConnection's
+            if(conn->connected() && !state->conn)
+            {
+                state->conn = conn;
+                // destroys the client's copy of this lambda, the connection keeps one
+                client->setConnectionCallback(defaultConnectionCallback);
+                // not from here: a CoConnection made on resuming replaces the
+                // connection's copy, which is the one running
+                conn->getLoop()->queueInLoop([handle]() { handle.resume(); });
+            }
+        });
+    client->connect();
+}
+
+CoAcceptor::CoAcceptor(TcpServer* server)
+    : M_state(new State)
+{
+    StatePtr state = M_state;
+    server->setMessageCallback(ignoreMessage);
+    // the server and every connection keep a copy, which may outlive us
+    server->setConnectionCallback(
+        [state](const TcpConnectionPtr& conn) { onConnection(state, conn); });
+}
+
+CoAcceptor::~CoAcceptor()
+{
+    std::deque<TcpConnectionPtr> accepted;
+    {
+        MutexLockGuard lock(M_state->mutex);
+        M_state->destroyed = true;
+        accepted.swap(M_state->accepted);
+    }
+    // no one will accept() them
+    for(size_t i = 0; i < accepted.size(); ++i)
+    {
+        accepted[i]->forceClose();
+    }
+}
+
+void CoAcceptor::onConnection(const StatePtr& state, const TcpConnectionPtr& conn)
+{
+    if(!conn->connected())
+    {
+        return;
+    }
+    std::coroutine_handle<> handle;
+    EventLoop* loop = NULL;
+    {
+        MutexLockGuard lock(state->mutex);
+        if(state->waiter)
+        {
+            state->waiter->M_conn = conn;
+            handle = state->waiterHandle;
+            loop = state->waiterLoop;
+            state->waiter = NULL;
+            state->waiterHandle = nullptr;
+            state->waiterLoop = NULL;
+        }
+        else if(!state->destroyed)
+        {
+            state->accepted.push_back(conn);
+            return;
+        }
+    }
+    if(loop != NULL)
+    {
+        loop->queueInLoop([handle]() { handle.resume(); });
+    }
+    else
+    {
+        // the acceptor is gone, no one will accept() it
+        conn->forceClose();
+    }
+}
+
+bool CoAcceptor::AcceptAwaiter::await_ready()
+{
+    MutexLockGuard lock(M_state->mutex);
+    if(M_state->accepted.empty())
+    {
+        return false;
+    }
+    M_conn = M_state->accepted.front();
+    M_state->accepted.pop_front();
+    return true;
+}
+
+bool CoAcceptor::AcceptAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    EventLoop* loop = EventLoop::getEventLoopOfCurrentThread();
+    assert(loop != NULL);
+    MutexLockGuard lock(M_state->mutex);
+    assert(M_state->waiter == NULL);
+    // a connection may have arrived since await_ready
+    if(!M_state->accepted.empty())
+    {
+        M_conn = M_state->accepted.front();
+        M_state->accepted.pop_front();
+        return false;
+    }
+    M_state->waiter = this;
+    M_state->waiterHandle = handle;
+    M_state->waiterLoop = loop;
+    return true;
+}
+
+#endif
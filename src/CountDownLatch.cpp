@@ -0,0 +1,33 @@
+#include "CountDownLatch.h"
+
+CountDownLatch::CountDownLatch(int count)
+    : M_mutex(),
+      M_condition(M_mutex),
+      M_count(count)
+{
+}
+
+void CountDownLatch::wait()
+{
+    MutexLockGuard lock(M_mutex);
+    while(M_count > 0)
+    {
+        M_condition.wait();
+    }
+}
+
+void CountDownLatch::countDown()
+{
+    MutexLockGuard lock(M_mutex);
+    --M_count;
+    if(M_count == 0)
+    {
+        M_condition.notifyAll();
+    }
+}
+
+int CountDownLatch::getCount() const
+{
+    MutexLockGuard lock(M_mutex);
+    return M_count;
+}
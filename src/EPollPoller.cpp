@@ -1,6 +1,7 @@
 #include "EPollPoller.h"
 #include "Logging.h"
 #include "Channel.h"
+#include "FastClock.h"
 
 #include <boost/static_assert.hpp>
 
@@ -8,6 +9,8 @@
 #include <errno.h>
 #include <poll.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 // On linux,the constants of poll(2) and epoll(4)
 // are expected to be the same. 
@@ -23,6 +26,26 @@ namespace
     const int kNew = -1;
     const int kAdded = 1;
     const int kDeleted = 2;
+
+    // epoll_event.data carries (generation, fd) instead of the Channel pointer,
+    // so an event for a removed channel is dropped rather than dereferenced.
+    inline uint64_t packEventData(int fd, uint32_t generation)
+    {
+        return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+    }
+
+    inline int eventFd(uint64_t data)
+    {
+        return static_cast<int>(static_cast<uint32_t>(data));
+    }
+
+    inline uint32_t eventGeneration(uint64_t data)
+    {
+        return static_cast<uint32_t>(data >> 32);
+    }
+
+    // epoll_pwait2 needs linux 5.11, cleared at the first ENOSYS
+    bool s_havePwait2 = true;  // atomic
 }
 
 EPollPoller::EPollPoller(EventLoop* loop)
@@ -44,12 +67,62 @@ EPollPoller::~EpollPoller()
 Timestamp EPollPoller::poll(int timeoutMs, ChannelList* activeChannels)
 {
     LOG_TRACE << "fd total count " << M_channels.size();
-    int numEvents = :epoll_wait(M_epollfd,
-                                &*M_events.begin(),
-                                static_cast<int>(M_events.size()),
-                                timeoutMs);
-    int savedErrno = errno;
-    Timestamp now(Timestamp::now());
+    applyPendingUpdates();
+    int numEvents = ::epoll_wait(M_epollfd,
+                                 &*M_events.begin(),
+                                 static_cast<int>(M_events.size()),
+                                 timeoutMs);
+    return collectEvents(numEvents, errno, activeChannels);
+}
+
+Timestamp EPollPoller::pollPrecise(int64_t timeoutNs, ChannelList* activeChannels)
+{
+    LOG_TRACE << "fd total count " << M_channels.size();
+    applyPendingUpdates();
+    struct timespec timeout;
+    timeout.tv_sec = static_cast<time_t>(timeoutNs / (1000 * 1000 * 1000));
+    timeout.tv_nsec = static_cast<long>(timeoutNs % (1000 * 1000 * 1000));
+    int numEvents = -1;
+    bool waited = false;
+#ifdef SYS_epoll_pwait2
+    if(__atomic_load_n(&s_havePwait2, __ATOMIC_RELAXED))
+    {
+        numEvents = static_cast<int>(::syscall(SYS_epoll_pwait2, M_epollfd,
+                                               &*M_events.begin(),
+                                               static_cast<int>(M_events.size()),
+                                               &timeout, NULL, 0));
+        waited = numEvents >= 0 || errno != ENOSYS;
+        if(!waited)
+        {
+            __atomic_store_n(&s_havePwait2, false, __ATOMIC_RELAXED);
+        }
+    }
+#endif
+    if(!waited)
+    {
+        // the epoll fd is readable while events are ready, ppoll() it
+        // for the precise timeout, then collect without blocking.
+        // A timeout has nothing to collect.
+        struct pollfd pfd;
+        pfd.fd = M_epollfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        numEvents = ::ppoll(&pfd, 1, &timeout, NULL);
+        if(numEvents > 0)
+        {
+            numEvents = ::epoll_wait(M_epollfd,
+                                     &*M_events.begin(),
+                                     static_cast<int>(M_events.size()),
+                                     0);
+        }
+    }
+    return collectEvents(numEvents, errno, activeChannels);
+}
+
+Timestamp EPollPoller::collectEvents(int numEvents, int savedErrno,
+                                     ChannelList* activeChannels)
+{
+    Timestamp now(FastClock::now());
     if(numEvents > 0)
     {
         LOG_TRACE << numEvents << " events happended";
@@ -82,14 +155,16 @@ void EPollPoller::fillActiveChannels(int numEvents, ChannelList* activeChannels)
     assert(implicit_cast<size_t>(numEvents) <= M_events.size());
     for(int i = 0; i < numEvents; ++i)
     {
-        CHannel *channel = static_cast<Channel*>(M_events[i].data.ptr);
-    #ifndef NDEBUG
-        int fd = channel->fd();
-        ChannelMap::const_iterator it = M_channels.find(fd);
-        assert(it != M_channels.end());
-    #endif
+        const uint64_t data = M_events[i].data.u64;
+        const int fd = eventFd(data);
+        Channel* channel = M_channels.find(fd);
+        if(channel == NULL || M_channels.generation(fd) != eventGeneration(data))
+        {
+            LOG_TRACE << "drop stale event of fd = " << fd;
+            continue;
+        }
         channel->set_revents(M_events[i].events);
-        M_activeChannels.push_back(channel);
+        activeChannels->push_back(channel);
     }
 }
 
@@ -97,72 +172,125 @@ void EPollPoller::updateChannel(Channel* channel)
 {
     Poller::assertInLoopThread();
     const int index = channel->index();
-    LOG_TRACE << "fd = "<<channel->fd()
+    const int fd = channel->fd();
+    LOG_TRACE << "fd = "<< fd
         << "events = "<<channel->events() << "index = " <<index;
     if(index == kNew || index == kDeleted)
     {
-        // a new one, add with EPOLL_CTL_ADD
-        int fd = channel->fd();
         if(index == kNew)
         {
-            assert(M_channels.find(fd) == M_channels.end());
-            M_channels[fd] = channel;
+            assert(M_channels.find(fd) == NULL);
+            M_channels.add(fd, channel);
         }
         else // index == kDeleted
         {
-            assert(M_channels.find(fd) != M_channels.end());
-            assert(M_channels[fd] == channel);
+            assert(M_channels.find(fd) == channel);
         }
-
         channel->set_index(kAdded);
-        update(EPOLL_CTL_ADD, channel);
     }
     else
     {
-        int fd = channel->fd();
-        (void)fd;
-        assert(M_channels.find(fd) != M_channels.end());
+        assert(M_channels.find(fd) == channel);
         assert(index == kAdded);
         if(channel->isNoneEvent())
         {
-            update(EPOLL_CTL_DEL, channel);
             channel->set_index(kDeleted);
         }
-        else
-        {
-            update(EPOLL_CTL_MOD, channel);
-        }
+    }
+    // epoll_ctl is deferred to applyPendingUpdates() before the next epoll_wait,
+    // toggles within one iteration, eg. EPOLLOUT on and off, cost no syscall.
+    if(static_cast<size_t>(fd) >= M_interests.size())
+    {
+        M_interests.resize(fd + 1);
+    }
+    Interest& interest = M_interests[fd];
+    if(!interest.dirty)
+    {
+        interest.dirty = true;
+        M_dirtyFds.push_back(fd);
     }
 }
 
-void EpollPoller::removeChannel(Channel* channel)
+void EPollPoller::removeChannel(Channel* channel)
 {
     Poller::assertInLoopThread();
     int fd = channel->fd();
     LOG_TRACE << "fd = " <<fd;
-    assert(M_channels.find(fd) != M_channels.end());
-    assert(M_channels[fd] == channel); 
+    assert(M_channels.find(fd) == channel);
     assert(channel->isNoneEvent());
     int index = channel->index();
     assert(index == kAdded || index == kDeleted);
+    (void)index;
+    // not deferred, the fd is usually closed right after, and may be reused.
+    Interest& interest = M_interests[fd];
+    if(interest.registered)
+    {
+        update(EPOLL_CTL_DEL, channel);
+        interest.registered = false;
+        interest.events = 0;
+    }
     size_t n = M_channels.erase(fd);
     (void)n;
     assert(n == 1);
+    channel->set_index(kNew);
+}
 
-    if(index == kAdded)
+void EPollPoller::applyPendingUpdates()
+{
+    for(std::vector<int>::const_iterator it = M_dirtyFds.begin();
+        it != M_dirtyFds.end(); ++it)
     {
-        update(EPOLL_CTL_DEL, channel);
+        const int fd = *it;
+        Interest& interest = M_interests[fd];
+        interest.dirty = false;
+        Channel* channel = M_channels.find(fd);
+        if(channel == NULL)
+        {
+            // removed in this iteration, EPOLL_CTL_DEL done by removeChannel()
+            continue;
+        }
+        const int wanted = channel->index() == kAdded ? interestOf(channel) : 0;
+        if(!interest.registered)
+        {
+            if(wanted != 0)
+            {
+                update(EPOLL_CTL_ADD, channel);
+                interest.registered = true;
+                interest.events = wanted;
+            }
+        }
+        else if(wanted == 0)
+        {
+            update(EPOLL_CTL_DEL, channel);
+            interest.registered = false;
+            interest.events = 0;
+        }
+        else if(wanted != interest.events)
+        {
+            update(EPOLL_CTL_MOD, channel);
+            interest.events = wanted;
+        }
     }
-    channel->set_index(kNew);
+    M_dirtyFds.clear();
+}
+
+int EPollPoller::interestOf(const Channel* channel)
+{
+    int events = channel->events();
+    if(channel->isEdgeTriggered())
+    {
+        events |= static_cast<int>(EPOLLET);
+    }
+    return events;
 }
 
 void EPollPoller::update(int operation, Channel* channel)
 {
     struct epoll_event event;
     bzero(&event, sizeof(event));
-    event.events = channel->events();
-    event.data.ptr = channel;
+    event.events = static_cast<uint32_t>(interestOf(channel));
     int fd = channel->fd();
+    event.data.u64 = packEventData(fd, M_channels.generation(fd));
     LOG_TRACE << "epoll_ctl op = " << operationToString(operation)
         << " fd = " << fd << "event = { "<<channel->eventsToString() << "}";
     if(::epoll_ctl(M_epollfd, operation, fd, &event) < 0)
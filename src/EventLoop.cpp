@@ -3,20 +3,31 @@
 #include "Logging.h"
 #include "Mutex.h"
 #include "Channel.h"
+#include "FastClock.h"
 #include "Poller.h"
 #include "SocketsOps.h"
 #include "TimerQueue.h"
 
 #include <boost/bind.hpp>
 
+#include <algorithm>
 #include <signal.h>
 #include <sys/eventfd.h>
+#include <sys/prctl.h>
 
 namespace
 {
 __thread EventLoop* t_loopInThisThread = 0;
 
 const int kPollTimeMs = 10000;
+const int64_t kPreciseSpinUs = 20;
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
 
 int createEventfd()
 {
@@ -42,6 +53,11 @@ public:
 
 IgnoreSigPipe initObj;
 
+inline int64_t microsecondsBetween(Timestamp high, Timestamp low)
+{
+    return high.microSecondsSinceEpoch() - low.microSecondsSinceEpoch();
+}
+
 EventLoop::EventLoop()
     : M_looping(false),
       M_quit(false),
@@ -49,11 +65,23 @@ EventLoop::EventLoop()
       M_callingPendingFunctors(false),
       M_iteration(0),
       M_threadId(CurrentThread::tid()),
+      M_pollReturnTime(FastClock::now()),
+      M_monotonicIteration(-1),
+      M_busySince(0),
+      M_activeFd(-1),
       M_poller(Poller::newDefaultPoller(this)),
       M_timerQueue(new TimerQueue(this)),
       M_wakeupFd(createEventfd()),
       M_wakeupChannel(new Channel(this, M_wakeupFd)),
-      M_currentActiveChannel(NULL)
+      M_currentActiveChannel(NULL),
+      M_priorityChannels(Channel::kNumPriorities),
+      M_priorityBudgets(Channel::kNumPriorities, 0),
+      M_preciseSpinUs(kPreciseSpinUs),
+      M_preciseTimerSlack(false),
+      M_savedTimerSlack(0),
+      M_functorBudgetCount(0),
+      M_functorBudgetUs(0),
+      M_deferredCount(0)
 {
     LOG_DEBUG << "EventLoop created "<< this << "in thread" << M_threadId;
     if(t_loopInThisThread)
@@ -66,9 +94,12 @@ EventLoop::EventLoop()
         t_loopInThisThread = this；
     }
     M_wakeupChannel->setReadCallback(std::bind(&EventLoop::handleRead, this));
+    M_wakeupChannel->setPriority(Channel::kControlPriority);
     //we are always reading the wakeupfd
     M_wakeupChannel->enableReading();
-
+#ifdef MUDUO_EVENTLOOP_STATS
+    M_timerQueue->setLatenessHistograms(&M_stats.timerLateness, &M_stats.preciseTimerLateness);
+#endif
 }
 
 EventLoop::~EventLoop()
@@ -81,6 +112,11 @@ EventLoop::~EventLoop()
     t_loopInThisThread = NULL;
 }
 
+EventLoop* EventLoop::getEventLoopOfCurrentThread()
+{
+    return t_loopInThisThread;
+}
+
 void EventLoop::loop()
 {
     assert(!M_looping);
@@ -92,26 +128,78 @@ void EventLoop::loop()
     while(!M_quit)
     {
         M_activeChannels.clear();
-        M_pollReturnTime = M_poller->poll(kPollTimeMs, &M_activeChannels);
-        ++M_iteration;
+#ifdef MUDUO_EVENTLOOP_STATS
+        Timestamp pollStart(FastClock::now());
+#endif
+        setBusySince(0);
+        Timestamp preciseWakeup(M_timerQueue->preciseWakeup());
+        Timestamp timerWakeup(M_timerQueue->pollWakeup());
+        setPreciseTimerSlack(preciseWakeup.valid());
+        // don't block while functors over the budget are waiting.
+        // Only precise timers need pollPrecise(), which may cost an extra
+        // syscall, poll driven ones are fine with a rounded up millisecond.
+        if(preciseWakeup.valid() && M_deferredFunctors.empty())
+        {
+            M_pollReturnTime = M_poller->pollPrecise(pollTimeoutNs(preciseWakeup, timerWakeup),
+                                                     &M_activeChannels);
+        }
+        else
+        {
+            int timeoutMs = M_deferredFunctors.empty() ? pollTimeoutMs(timerWakeup) : 0;
+            M_pollReturnTime = M_poller->poll(timeoutMs, &M_activeChannels);
+        }
+        setBusySince(M_pollReturnTime.microSecondsSinceEpoch());
+        __atomic_store_n(&M_iteration, M_iteration + 1, __ATOMIC_RELAXED);
+#ifdef MUDUO_EVENTLOOP_STATS
+        M_stats.pollWait.record(microsecondsBetween(M_pollReturnTime, pollStart));
+#endif
+        if(preciseWakeup.valid())
+        {
+            runPreciseTimers(preciseWakeup);
+        }
         if(Logger::logLevel() <= Logger::TRACE)
         {
             printActiveChannels();
         }
-        // TODO sort channel by priority
         M_eventHandling = true;
-        for(ChannelList::iterator it = M_activeChannels.begin();
-            it != M_activeChannels.end(), ++it)
-        {
-            M_currentActiveChannel = *it;
-            M_currentActiveChannel->handleEvent(M_pollReturnTime);
-        }
+        dispatchActiveChannels();
         M_currentActiveChannel = NULL;
+        setActiveFd(-1);
         M_eventHandling = false;
+        if(M_timerQueue->pollDriven())
+        {
+            M_timerQueue->runExpiredTimers();
+        }
         doPendingFunctors();
+#ifdef MUDUO_EVENTLOOP_STATS
+        M_stats.iteration.record(microsecondsBetween(FastClock::now(), M_pollReturnTime));
+#endif
+    }
+
+    setPreciseTimerSlack(false);
+
+    // functors over the budget were accepted, don't drop them on quit.
+    // Only those, once and without a budget: what they queue in turn is left
+    // like anything queued after quit, or a functor requeueing itself would
+    // keep loop() from returning.
+    std::deque<Functor> deferred;
+    deferred.swap(M_deferredFunctors);
+#ifdef MUDUO_EVENTLOOP_STATS
+    M_deferredEnqueueTimes.clear();
+#endif
+    __atomic_store_n(&M_deferredCount, 0, __ATOMIC_RELAXED);
+    setCallingPendingFunctors(true);
+    for(size_t i = 0; i < deferred.size(); ++i)
+    {
+        deferred[i]();
     }
+    setCallingPendingFunctors(false);
 
     LOG_TRACE << "EventLoop " << this << "stop looping";
+    // not busy any more, or a watchdog would see a stall growing until the
+    // loop destructs, and signal a thread that may be gone
+    setBusySince(0);
+    setActiveFd(-1);
     M_looping = false;
 }
 
@@ -141,9 +229,15 @@ void EventLoop::runInLoop(const Functor& cb)
 
 void EventLoop::queueInLoop(const Functor &cb)
 {
+#ifdef MUDUO_EVENTLOOP_STATS
+    int64_t enqueueTime = FastClock::now().microSecondsSinceEpoch();
+#endif
     {
         MutexLockGuard lock(M_mutex);
         M_pendingFunctors.push_back(cb);
+#ifdef MUDUO_EVENTLOOP_STATS
+        M_pendingEnqueueTimes.push_back(enqueueTime);
+#endif
     }
 
     if(!isInLoopThread() || M_callingPendingFunctors)
@@ -155,29 +249,210 @@ void EventLoop::queueInLoop(const Functor &cb)
 size_t EventLoop::queueSize() const 
 {
     MutexLockGuard lock(M_mutex);
-    return M_pendingFunctors.size();
+    return M_pendingFunctors.size() + __atomic_load_n(&M_deferredCount, __ATOMIC_RELAXED);
 }
 
-TimerId EventLoop::runAt(const Timestamp& time, const TimerCallback& cb)
+TimerId EventLoop::runAt(const Timestamp& time, const TimerCallback& cb, double slack)
 {
-    return M_timerQueue->addTimer(cb, time, 0.0);
+    return M_timerQueue->addTimer(cb, FastClock::toMonotonic(time), 0.0, slack);
 }
 
-TimerId EventLoop::runAfter(double delay, const TimerCallback& cb)
+TimerId EventLoop::runAfter(double delay, const TimerCallback& cb, double slack)
 {
-    Timestamp time(addTime(Timestamp::now(),interval));
-    return M_timerQueue->addTimer(cb， time);
+    Timestamp time(addTime(timerBase(), delay));
+    return M_timerQueue->addTimer(cb, time, 0.0, slack);
 }
 
-TimerId EventLoop::runEvery(double interval, const TimerCallback& cb)
+TimerId EventLoop::runEvery(double interval, const TimerCallback& cb, double slack)
 {
-    Timestamp time(addTime(Timestamp::now(), interval));
-    return M_timerQueue->addTimer(cb, time, interval);
+    Timestamp time(addTime(timerBase(), interval));
+    return M_timerQueue->addTimer(cb, time, interval, slack);
+}
+
+TimerId EventLoop::runAtPrecise(const Timestamp& time, const TimerCallback& cb)
+{
+    return M_timerQueue->addPreciseTimer(cb, FastClock::toMonotonic(time), 0.0);
+}
+
+TimerId EventLoop::runAfterPrecise(double delay, const TimerCallback& cb)
+{
+    // not loop time, which lags by the handlers run so far
+    Timestamp time(addTime(preciseMonotonicNow(), delay));
+    return M_timerQueue->addPreciseTimer(cb, time, 0.0);
+}
+
+TimerId EventLoop::runEveryPrecise(double interval, const TimerCallback& cb)
+{
+    Timestamp time(addTime(preciseMonotonicNow(), interval));
+    return M_timerQueue->addPreciseTimer(cb, time, interval);
+}
+
+void EventLoop::setPreciseTimerSpin(double seconds)
+{
+    assertInLoopThread();
+    M_preciseSpinUs = static_cast<int64_t>(seconds * Timestamp::kMicroSecondsPerSecond);
 }
 
 void EventLoop::cancel(TimerId timerId)
 {
-    return M_timerQueue->cancel(TimerId);
+    return M_timerQueue->cancel(timerId);
+}
+
+std::vector<TimerId> EventLoop::addTimers(const std::vector<TimerSpec>& timers)
+{
+    std::vector<TimerId> timerIds;
+    // one offset for the batch, like runAt() for each
+    int64_t offset = FastClock::toMonotonic(Timestamp(0)).microSecondsSinceEpoch();
+    M_timerQueue->addTimers(timers, offset, &timerIds);
+    return timerIds;
+}
+
+void EventLoop::cancel(const std::vector<TimerId>& timerIds)
+{
+    M_timerQueue->cancel(timerIds);
+}
+
+void EventLoop::setTimerEngine(TimerEngine::Kind kind, double tickSeconds)
+{
+    assertInLoopThread();
+    M_timerQueue->setEngine(TimerEngine::newTimerEngine(kind, tickSeconds));
+}
+
+void EventLoop::setPollDrivenTimers(bool on)
+{
+    assertInLoopThread();
+    M_timerQueue->setPollDriven(on);
+}
+
+int64_t EventLoop::timerReprograms() const
+{
+    return M_timerQueue->reprograms();
+}
+
+int64_t EventLoop::timerReprogramsSaved() const
+{
+    return M_timerQueue->reprogramsSaved();
+}
+
+Timestamp EventLoop::preciseNow() const
+{
+    return FastClock::now();
+}
+
+Timestamp EventLoop::monotonicNow() const
+{
+    if(M_monotonicIteration != M_iteration)
+    {
+        M_monotonicNow = FastClock::monotonicNow();
+        M_monotonicIteration = M_iteration;
+    }
+    return M_monotonicNow;
+}
+
+Timestamp EventLoop::preciseMonotonicNow() const
+{
+    return FastClock::monotonicNow();
+}
+
+int64_t EventLoop::pollTimeoutNs(Timestamp preciseWakeup, Timestamp timerWakeup)
+{
+    int64_t now = FastClock::monotonicNow().microSecondsSinceEpoch();
+    int64_t microseconds = static_cast<int64_t>(kPollTimeMs) * 1000;
+    if(preciseWakeup.valid())
+    {
+        microseconds = std::min(microseconds,
+                                preciseWakeup.microSecondsSinceEpoch() - now - M_preciseSpinUs);
+    }
+    if(timerWakeup.valid())
+    {
+        microseconds = std::min(microseconds, timerWakeup.microSecondsSinceEpoch() - now);
+    }
+    return microseconds <= 0 ? 0 : microseconds * 1000;
+}
+
+int EventLoop::pollTimeoutMs(Timestamp timerWakeup)
+{
+    if(!timerWakeup.valid())
+    {
+        return kPollTimeMs;
+    }
+    int64_t microseconds = timerWakeup.microSecondsSinceEpoch()
+                           - FastClock::monotonicNow().microSecondsSinceEpoch();
+    if(microseconds <= 0)
+    {
+        return 0;
+    }
+    // rounded up, waking before the timer is due would poll again for nothing
+    return static_cast<int>(std::min(static_cast<int64_t>(kPollTimeMs),
+                                     (microseconds + 999) / 1000));
+}
+
+// The default 50us slack of hrtimers would dwarf the spin, it is cut to
+// 1ns while precise timers are pending. Timer slack is per thread, the
+// thread's own value is put back afterwards.
+void EventLoop::setPreciseTimerSlack(bool on)
+{
+    if(on == M_preciseTimerSlack)
+    {
+        return;
+    }
+    if(on)
+    {
+        int slack = ::prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+        if(slack < 0 || ::prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0) < 0)
+        {
+            LOG_SYSERR << "prctl(PR_SET_TIMERSLACK)";
+            return;
+        }
+        M_savedTimerSlack = static_cast<unsigned long>(slack);
+    }
+    else if(::prctl(PR_SET_TIMERSLACK, M_savedTimerSlack, 0, 0, 0) < 0)
+    {
+        LOG_SYSERR << "prctl(PR_SET_TIMERSLACK) restore";
+    }
+    M_preciseTimerSlack = on;
+}
+
+void EventLoop::runPreciseTimers(Timestamp wakeup)
+{
+    Timestamp now(FastClock::monotonicNow());
+    if(now < wakeup)
+    {
+        // woke early for the final spin, events come first if there are any,
+        // the next poll doesn't block
+        if(!M_activeChannels.empty()
+           || wakeup.microSecondsSinceEpoch() - now.microSecondsSinceEpoch() > M_preciseSpinUs)
+        {
+            return;
+        }
+        while(now < wakeup)
+        {
+            cpuRelax();
+            now = FastClock::monotonicNow();
+        }
+    }
+    M_timerQueue->runPreciseTimers(now);
+}
+
+Timestamp EventLoop::timerBase() const
+{
+    // loop time is only meaningful in the loop thread
+    return isInLoopThread() ? monotonicNow() : preciseMonotonicNow();
+}
+
+void EventLoop::setPriorityBudget(int priority, double seconds)
+{
+    assertInLoopThread();
+    assert(0 <= priority && priority < Channel::kNumPriorities);
+    M_priorityBudgets[priority] =
+        static_cast<int64_t>(seconds * Timestamp::kMicroSecondsPerSecond);
+}
+
+void EventLoop::setFunctorBudget(size_t maxFunctors, double seconds)
+{
+    assertInLoopThread();
+    M_functorBudgetCount = maxFunctors;
+    M_functorBudgetUs = static_cast<int64_t>(seconds * Timestamp::kMicroSecondsPerSecond);
 }
 
 void EventLoop::updateChannel(Channel* channel)
@@ -236,16 +511,150 @@ void EventLoop::handleRead()
 void EventLoop::doPendingFunctors()
 {
     std::vector<Functor> functors;
-    M_callingPendingFunctors = true;
+#ifdef MUDUO_EVENTLOOP_STATS
+    std::vector<int64_t> enqueueTimes;
+#endif
+    setCallingPendingFunctors(true);
     {
         MutexLockGuard lock(M_mutex);
         functors.swap(M_pendingFunctors);
+#ifdef MUDUO_EVENTLOOP_STATS
+        enqueueTimes.swap(M_pendingEnqueueTimes);
+#endif
+    }
+    const bool timed = M_functorBudgetUs > 0;
+#ifdef MUDUO_EVENTLOOP_STATS
+    M_stats.queueDepth.record(static_cast<int64_t>(functors.size() + M_deferredFunctors.size()));
+    Timestamp start(FastClock::now());
+#else
+    Timestamp start(timed ? FastClock::now() : Timestamp());
+#endif
+    Timestamp functorStart(start);
+    size_t ran = 0;
+    bool overBudget = false;
+
+    // leftovers of the last iteration go first, they are older
+    while(!M_deferredFunctors.empty() && !overBudget)
+    {
+        Functor functor;
+        functor.swap(M_deferredFunctors.front());
+        M_deferredFunctors.pop_front();
+#ifdef MUDUO_EVENTLOOP_STATS
+        M_stats.queueDelay.record(functorStart.microSecondsSinceEpoch() - M_deferredEnqueueTimes.front());
+        M_deferredEnqueueTimes.pop_front();
+#endif
+        functor();
+        ++ran;
+#ifdef MUDUO_EVENTLOOP_STATS
+        functorStart = FastClock::now();
+#else
+        if(timed)
+        {
+            functorStart = FastClock::now();
+        }
+#endif
+        overBudget = functorBudgetExceeded(ran, microsecondsBetween(functorStart, start));
     }
-    for(size_t i = 0; i < functors.size(); ++i)
+
+    size_t i = 0;
+    for(; i < functors.size() && !overBudget; ++i)
     {
+#ifdef MUDUO_EVENTLOOP_STATS
+        M_stats.queueDelay.record(functorStart.microSecondsSinceEpoch() - enqueueTimes[i]);
+#endif
         functors[i]();
+        ++ran;
+#ifdef MUDUO_EVENTLOOP_STATS
+        functorStart = FastClock::now();
+#else
+        if(timed)
+        {
+            functorStart = FastClock::now();
+        }
+#endif
+        overBudget = functorBudgetExceeded(ran, microsecondsBetween(functorStart, start));
+    }
+
+    // carried into the next iteration, which polls without blocking
+    for(; i < functors.size(); ++i)
+    {
+        M_deferredFunctors.push_back(Functor());
+        M_deferredFunctors.back().swap(functors[i]);
+#ifdef MUDUO_EVENTLOOP_STATS
+        M_deferredEnqueueTimes.push_back(enqueueTimes[i]);
+#endif
+    }
+    __atomic_store_n(&M_deferredCount, M_deferredFunctors.size(), __ATOMIC_RELAXED);
+#ifdef MUDUO_EVENTLOOP_STATS
+    if(ran > 0)
+    {
+        M_stats.pendingFunctors.record(microsecondsBetween(functorStart, start));
+    }
+    if(!M_deferredFunctors.empty())
+    {
+        M_stats.deferredFunctors.record(static_cast<int64_t>(M_deferredFunctors.size()));
+    }
+#endif
+    setCallingPendingFunctors(false);
+}
+
+bool EventLoop::functorBudgetExceeded(size_t ran, int64_t elapsedUs) const
+{
+    return (M_functorBudgetCount > 0 && ran >= M_functorBudgetCount)
+           || (M_functorBudgetUs > 0 && elapsedUs >= M_functorBudgetUs);
+}
+
+void EventLoop::dispatchActiveChannels()
+{
+    for(size_t p = 0; p < M_priorityChannels.size(); ++p)
+    {
+        M_priorityChannels[p].clear();
+    }
+    for(ChannelList::iterator it = M_activeChannels.begin();
+        it != M_activeChannels.end(); ++it)
+    {
+        M_priorityChannels[(*it)->priority()].push_back(*it);
+    }
+
+    for(size_t p = 0; p < M_priorityChannels.size(); ++p)
+    {
+        const ChannelList& channels = M_priorityChannels[p];
+        const int64_t budget = M_priorityBudgets[p];
+        bool overBudget = false;
+        Timestamp start;
+        if(budget > 0 && !channels.empty())
+        {
+            start = FastClock::now();
+        }
+        for(ChannelList::const_iterator it = channels.begin();
+            it != channels.end(); ++it)
+        {
+            // level-triggered channels skipped here are reported again by next poll,
+            // edge-triggered ones would lose their event.
+            if(overBudget && !(*it)->isEdgeTriggered())
+            {
+                continue;
+            }
+            M_currentActiveChannel = *it;
+            setActiveFd(M_currentActiveChannel->fd());
+#ifdef MUDUO_EVENTLOOP_STATS
+            Timestamp handlerStart(FastClock::now());
+            M_currentActiveChannel->handleEvent(M_pollReturnTime);
+            Timestamp handlerEnd(FastClock::now());
+            M_stats.handler[p].record(microsecondsBetween(handlerEnd, handlerStart));
+#else
+            M_currentActiveChannel->handleEvent(M_pollReturnTime);
+#endif
+            if(budget > 0 && !overBudget)
+            {
+#ifdef MUDUO_EVENTLOOP_STATS
+                overBudget = microsecondsBetween(handlerEnd, start) >= budget;
+#else
+                overBudget = microsecondsBetween(FastClock::now(), start) >= budget;
+#endif
+            }
+        }
     }
-    M_callingPendingFunctors = false;
 }
 
 void EventLoop::printActiveChannels() const 
@@ -11,7 +11,8 @@ EventLoopThread::EventLoopThread(const ThreadInitCallback& cb,
       M_thread(boost::bind(&EventLoopThread::threadFunc, this), name),
       M_mutex(),
       M_cond(M_mutex),
-      M_callback(cb)
+      M_callback(cb),
+      M_placementIndex(0)
 {
 
 }   
@@ -45,6 +46,8 @@ EventLoop* EventLoopThread::startLoop()
 
 void EventLoopThread::threadFunc()
 {
+    // first, so the loop and what it allocates are on this thread's node
+    M_placement.apply(M_placementIndex);
     EventLoop loop;
 
     if(M_callbck)
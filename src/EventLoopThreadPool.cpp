@@ -34,6 +34,7 @@ void EventLoopThreadPool::start(const ThreadInitCallback& cb)
         char buf[name.size() + 32];
         snprintf(buf, sizeof(buf), "%s%d", name.c_str(), i);
         EventLoopThread* t = new EventLoopThread(cb, buf);
+        t->setPlacement(M_placement, i);
         M_threads.push_back(t);
         M_loops.push_back(t->startLoop());
     }
@@ -0,0 +1,145 @@
+#include "FastClock.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define FASTCLOCK_HAVE_TSC 1
+#endif
+
+namespace
+{
+const int kCalibrationMicroseconds = 20 * 1000;
+const int64_t kReanchorSeconds = 1;
+
+int64_t s_ticksPerSecond = 0;  // atomic, 0 while disabled
+
+struct Anchor
+{
+    uint64_t ticks;
+    int64_t microseconds;
+};
+
+__thread Anchor t_wallAnchor = { 0, 0 };
+__thread Anchor t_monotonicAnchor = { 0, 0 };
+__thread int64_t t_lastMonotonic = 0;  // last monotonicNow() of this thread
+
+Timestamp monotonicTimestamp()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return Timestamp(static_cast<int64_t>(ts.tv_sec) * Timestamp::kMicroSecondsPerSecond
+                     + ts.tv_nsec / 1000);
+}
+
+#ifdef FASTCLOCK_HAVE_TSC
+inline uint64_t readTsc()
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+bool hasInvariantTsc()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+    {
+        return false;
+    }
+    return (edx & (1u << 8)) != 0;
+}
+
+int64_t monotonicNanoseconds()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+#endif
+
+Timestamp readClock(Anchor* anchor, Timestamp (*clock)())
+{
+#ifdef FASTCLOCK_HAVE_TSC
+    int64_t ticksPerSecond = __atomic_load_n(&s_ticksPerSecond, __ATOMIC_RELAXED);
+    if(ticksPerSecond != 0)
+    {
+        uint64_t elapsed = readTsc() - anchor->ticks;
+        // also catches a thread migrated to a cpu whose TSC is behind
+        if(anchor->ticks != 0 && elapsed < static_cast<uint64_t>(ticksPerSecond * kReanchorSeconds))
+        {
+            return Timestamp(anchor->microseconds + static_cast<int64_t>(
+                static_cast<double>(elapsed) * Timestamp::kMicroSecondsPerSecond
+                / static_cast<double>(ticksPerSecond)));
+        }
+        Timestamp reference(clock());
+        anchor->ticks = readTsc();
+        anchor->microseconds = reference.microSecondsSinceEpoch();
+        return reference;
+    }
+#endif
+    return clock();
+}
+}
+
+bool FastClock::enable()
+{
+#ifdef FASTCLOCK_HAVE_TSC
+    if(!hasInvariantTsc())
+    {
+        return false;
+    }
+    int64_t ns0 = monotonicNanoseconds();
+    uint64_t tsc0 = readTsc();
+    ::usleep(kCalibrationMicroseconds);
+    int64_t ns1 = monotonicNanoseconds();
+    uint64_t tsc1 = readTsc();
+    if(ns1 <= ns0 || tsc1 <= tsc0)
+    {
+        return false;
+    }
+    int64_t ticksPerSecond = static_cast<int64_t>(
+        static_cast<double>(tsc1 - tsc0) * 1e9 / static_cast<double>(ns1 - ns0));
+    __atomic_store_n(&s_ticksPerSecond, ticksPerSecond, __ATOMIC_RELAXED);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool FastClock::enabled()
+{
+    return __atomic_load_n(&s_ticksPerSecond, __ATOMIC_RELAXED) != 0;
+}
+
+Timestamp FastClock::now()
+{
+    return readClock(&t_wallAnchor, &Timestamp::now);
+}
+
+Timestamp FastClock::monotonicNow()
+{
+    // with the tick rate calibrated a little low, extrapolation runs ahead
+    // of the clock and the re-anchor would step back
+    int64_t microseconds =
+        readClock(&t_monotonicAnchor, &monotonicTimestamp).microSecondsSinceEpoch();
+    if(microseconds < t_lastMonotonic)
+    {
+        return Timestamp(t_lastMonotonic);
+    }
+    t_lastMonotonic = microseconds;
+    return Timestamp(microseconds);
+}
+
+Timestamp FastClock::systemMonotonicNow()
+{
+    return monotonicTimestamp();
+}
+
+Timestamp FastClock::toMonotonic(Timestamp wallTime)
+{
+    int64_t offset = monotonicNow().microSecondsSinceEpoch() - now().microSecondsSinceEpoch();
+    return Timestamp(wallTime.microSecondsSinceEpoch() + offset);
+}
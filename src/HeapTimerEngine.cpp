@@ -0,0 +1,118 @@
+#include "HeapTimerEngine.h"
+
+#include "Timer.h"
+
+#include <assert.h>
+
+HeapTimerEngine::HeapTimerEngine()
+{
+}
+
+HeapTimerEngine::~HeapTimerEngine()
+{
+}
+
+bool HeapTimerEngine::insert(Timer* timer)
+{
+    assert(timer->M_index == -1);
+    Node node = { timer->expiration().microSecondsSinceEpoch(), timer };
+    M_heap.push_back(node);
+    set(M_heap.size() - 1, node);
+    siftUp(M_heap.size() - 1);
+    return timer->M_index == 0;
+}
+
+void HeapTimerEngine::cancel(Timer* timer)
+{
+    assert(timer->pending());
+    assert(M_heap[timer->M_index].timer == timer);
+    removeAt(timer->M_index);
+}
+
+void HeapTimerEngine::getExpired(Timestamp now, std::vector<Timer*>* expired)
+{
+    const int64_t nowUs = now.microSecondsSinceEpoch();
+    while(!M_heap.empty() && M_heap[0].expiration <= nowUs)
+    {
+        expired->push_back(M_heap[0].timer);
+        removeAt(0);
+    }
+}
+
+Timestamp HeapTimerEngine::nextWakeup()
+{
+    return M_heap.empty() ? Timestamp::invalid() : Timestamp(M_heap[0].expiration);
+}
+
+void HeapTimerEngine::set(size_t index, const Node& node)
+{
+    M_heap[index] = node;
+    node.timer->M_index = static_cast<int>(index);
+}
+
+void HeapTimerEngine::siftUp(size_t index)
+{
+    Node node = M_heap[index];
+    while(index > 0)
+    {
+        size_t parent = (index - 1) / kArity;
+        if(M_heap[parent].expiration <= node.expiration)
+        {
+            break;
+        }
+        set(index, M_heap[parent]);
+        index = parent;
+    }
+    set(index, node);
+}
+
+void HeapTimerEngine::siftDown(size_t index)
+{
+    const size_t n = M_heap.size();
+    Node node = M_heap[index];
+    for(;;)
+    {
+        size_t first = index * kArity + 1;
+        if(first >= n)
+        {
+            break;
+        }
+        size_t last = first + kArity < n ? first + kArity : n;
+        size_t least = first;
+        for(size_t child = first + 1; child < last; ++child)
+        {
+            if(M_heap[child].expiration < M_heap[least].expiration)
+            {
+                least = child;
+            }
+        }
+        if(node.expiration <= M_heap[least].expiration)
+        {
+            break;
+        }
+        set(index, M_heap[least]);
+        index = least;
+    }
+    set(index, node);
+}
+
+void HeapTimerEngine::removeAt(size_t index)
+{
+    assert(index < M_heap.size());
+    Timer* timer = M_heap[index].timer;
+    Node last = M_heap.back();
+    M_heap.pop_back();
+    if(index < M_heap.size())
+    {
+        M_heap[index] = last;
+        if(index > 0 && last.expiration < M_heap[(index - 1) / kArity].expiration)
+        {
+            siftUp(index);
+        }
+        else
+        {
+            siftDown(index);
+        }
+    }
+    timer->M_index = -1;
+}
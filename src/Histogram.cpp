@@ -0,0 +1,83 @@
+#include "Histogram.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+Histogram::Histogram()
+    : M_count(0),
+      M_sum(0),
+      M_max(0)
+{
+    bzero(M_buckets, sizeof(M_buckets));
+}
+
+Histogram::Snapshot Histogram::snapshot() const
+{
+    Snapshot snap;
+    snap.count = load(&M_count);
+    snap.sum = load(&M_sum);
+    snap.max = load(&M_max);
+    for(int i = 0; i < kNumBuckets; ++i)
+    {
+        snap.buckets[i] = load(&M_buckets[i]);
+    }
+    return snap;
+}
+
+double Histogram::Snapshot::mean() const
+{
+    return count > 0 ? static_cast<double>(sum) / static_cast<double>(count) : 0.0;
+}
+
+int64_t Histogram::Snapshot::percentile(double p) const
+{
+    int64_t total = 0;
+    for(int i = 0; i < kNumBuckets; ++i)
+    {
+        total += buckets[i];
+    }
+    if(total == 0)
+    {
+        return 0;
+    }
+    int64_t rank = static_cast<int64_t>(p * static_cast<double>(total) + 0.5);
+    if(rank < 1)
+    {
+        rank = 1;
+    }
+    int64_t seen = 0;
+    for(int i = 0; i < kNumBuckets; ++i)
+    {
+        seen += buckets[i];
+        if(seen >= rank)
+        {
+            int64_t upper = (i == 0) ? 0 : (static_cast<int64_t>(1) << i) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+void Histogram::Snapshot::merge(const Snapshot& other)
+{
+    count += other.count;
+    sum += other.sum;
+    if(other.max > max)
+    {
+        max = other.max;
+    }
+    for(int i = 0; i < kNumBuckets; ++i)
+    {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+string Histogram::Snapshot::toString() const
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf),
+             "count=%" PRId64 " mean=%.1f p50=%" PRId64 " p99=%" PRId64 " max=%" PRId64,
+             count, mean(), percentile(0.5), percentile(0.99), max);
+    return buf;
+}
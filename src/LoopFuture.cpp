@@ -0,0 +1,30 @@
+#include "LoopFuture.h"
+
+#include "Exception.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void detail::abortOnFutureException()
+{
+    try
+    {
+        throw;
+    }
+    catch(const Exception& ex)
+    {
+        fprintf(stderr, "exception caught completing a LoopFuture\n");
+        fprintf(stderr, "reason: %s\n", ex.what());
+        fprintf(stderr, "stack trace: %s\n", ex.stackTrace());
+    }
+    catch(const std::exception& ex)
+    {
+        fprintf(stderr, "exception caught completing a LoopFuture\n");
+        fprintf(stderr, "reason: %s\n", ex.what());
+    }
+    catch(...)
+    {
+        fprintf(stderr, "unknown exception caught completing a LoopFuture\n");
+    }
+    abort();
+}
@@ -0,0 +1,337 @@
+#include "LoopWatchdog.h"
+
+#include "Logging.h"
+#include "CurrentThread.h"
+#include "EventLoop.h"
+#include "InetAddress.h"
+#include "SocketsOps.h"
+#include "Timestamp.h"
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+
+#include <errno.h>
+#include <execinfo.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+const int kMaxFrames = 64;
+const int kSampleClaimed = -1;
+
+// one stack sample at a time, serialized by g_sampleMutex
+MutexLock g_sampleMutex;
+int g_sampleSeq = 0;               // @GuardedBy g_sampleMutex
+// Sequence number of the outstanding request, 0 if none, kSampleClaimed
+// while a handler writes g_frames. Every signal carries the number of its
+// request, so the handler of a request that timed out finds a mismatch
+// and leaves g_frames alone.
+int g_sampleArmed = 0;             // atomic
+int g_sampleDone = 0;              // atomic, sequence number of the last sample
+void* g_frames[kMaxFrames];
+int g_numFrames = 0;
+
+// handlers found by installSampleHandler(), indexed by signal
+struct sigaction g_previousActions[NSIG];
+bool g_handlerInstalled[NSIG];     // @GuardedBy g_sampleMutex
+
+void sampleStackHandler(int signo, siginfo_t* info, void* context)
+{
+    if(info->si_code != SI_QUEUE || info->si_pid != ::getpid())
+    {
+        //not ours, hand it to the handler we replaced
+        const struct sigaction& previous = g_previousActions[signo];
+        if(previous.sa_flags & SA_SIGINFO)
+        {
+            previous.sa_sigaction(signo, info, context);
+        }
+        else if(previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)
+        {
+            previous.sa_handler(signo);
+        }
+        return;
+    }
+
+    int seq = info->si_value.sival_int;
+    if(__atomic_compare_exchange_n(&g_sampleArmed, &seq, kSampleClaimed, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        int savedErrno = errno;
+        g_numFrames = ::backtrace(g_frames, kMaxFrames);
+        errno = savedErrno;
+        __atomic_store_n(&g_sampleDone, info->si_value.sival_int, __ATOMIC_RELEASE);
+    }
+}
+
+bool installSampleHandler(int signo)
+{
+    MutexLockGuard lock(g_sampleMutex);
+    if(g_handlerInstalled[signo])
+    {
+        return true;
+    }
+    struct sigaction sa;
+    bzero(&sa, sizeof(sa));
+    sa.sa_sigaction = sampleStackHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    //saved before installing, the handler may run as soon as it is installed
+    if(::sigaction(signo, NULL, &g_previousActions[signo]) < 0
+       || ::sigaction(signo, &sa, NULL) < 0)
+    {
+        LOG_SYSERR << "LoopWatchdog installSampleHandler sigaction";
+        return false;
+    }
+    g_handlerInstalled[signo] = true;
+    return true;
+}
+
+void defaultStallCallback(const LoopWatchdog::StallReport& report)
+{
+    LOG_WARN << "EventLoop " << report.loopName << " in thread " << report.threadId
+             << " stalled for " << report.stalledUs << " us "
+             << (report.inPendingFunctors ? "in pending functors" : "in channel handler")
+             << " fd = " << report.fd << " (may be stale) peer = " << report.peer
+             << "\n" << report.stackTrace;
+}
+}
+
+LoopWatchdog::LoopWatchdog(double stallBudgetSeconds, const string& nameArg)
+    : M_stallBudgetUs(static_cast<int64_t>(stallBudgetSeconds * Timestamp::kMicroSecondsPerSecond)),
+      M_sampleSignal(SIGUSR2),
+      M_stallCallback(defaultStallCallback),
+      M_thread(boost::bind(&LoopWatchdog::threadFunc, this), nameArg),
+      M_running(false)
+{
+    assert(M_stallBudgetUs > 0);
+    //the first backtrace() may load libgcc and malloc, don't let it happen in the handler
+    void* frame;
+    ::backtrace(&frame, 1);
+}
+
+LoopWatchdog::~LoopWatchdog()
+{
+    if(M_running)
+    {
+        stop();
+    }
+}
+
+void LoopWatchdog::start()
+{
+    assert(!M_running);
+    if(M_sampleSignal != 0 && !installSampleHandler(M_sampleSignal))
+    {
+        M_sampleSignal = 0;
+    }
+    M_running = true;
+    M_thread.start();
+}
+
+void LoopWatchdog::stop()
+{
+    M_running = false;
+    M_thread.join();
+}
+
+void LoopWatchdog::watch(EventLoop* loop, const string& loopName)
+{
+    WatchedLoop w;
+    w.loop = loop;
+    w.name = loopName;
+    w.lastIteration = loop->iteration();
+    w.stallBusySince = 0;
+    w.lastSeenUs = 0;
+    w.reported = false;
+    bzero(&w.stats, sizeof(w.stats));
+
+    MutexLockGuard lock(M_mutex);
+    M_loops.push_back(w);
+}
+
+void LoopWatchdog::unwatch(EventLoop* loop)
+{
+    MutexLockGuard lock(M_mutex);
+    for(std::vector<WatchedLoop>::iterator it = M_loops.begin();
+        it != M_loops.end(); ++it)
+    {
+        if(it->loop == loop)
+        {
+            M_loops.erase(it);
+            break;
+        }
+    }
+}
+
+LoopWatchdog::Stats LoopWatchdog::stats(EventLoop* loop) const
+{
+    Stats result;
+    bzero(&result, sizeof(result));
+    MutexLockGuard lock(M_mutex);
+    for(size_t i = 0; i < M_loops.size(); ++i)
+    {
+        const WatchedLoop& w = M_loops[i];
+        if(w.loop == loop)
+        {
+            result = w.stats;
+            //a stall still going on, which may never end, counts as seen so far
+            if(w.stallBusySince != 0)
+            {
+                const int64_t stalledUs = w.lastSeenUs - w.stallBusySince;
+                ++result.stallCount;
+                result.totalStallUs += stalledUs;
+                result.maxStallUs = std::max(result.maxStallUs, stalledUs);
+            }
+            break;
+        }
+    }
+    return result;
+}
+
+void LoopWatchdog::threadFunc()
+{
+    //checks four times per budget, so a stall is caught within 125% of it
+    const int64_t intervalUs = std::max(M_stallBudgetUs / 4, static_cast<int64_t>(1000));
+    std::vector<StallReport> reports;
+    while(M_running)
+    {
+        CurrentThread::sleepUsec(intervalUs);
+        reports.clear();
+        check(Timestamp::now().microSecondsSinceEpoch(), &reports);
+        //outside M_mutex, sampling waits for the loop thread
+        for(size_t i = 0; i < reports.size(); ++i)
+        {
+            if(M_sampleSignal != 0)
+            {
+                reports[i].stackTrace = sampleStack(reports[i].threadId);
+            }
+            if(M_stallCallback)
+            {
+                M_stallCallback(reports[i]);
+            }
+        }
+    }
+}
+
+void LoopWatchdog::check(int64_t nowUs, std::vector<StallReport>* reports)
+{
+    MutexLockGuard lock(M_mutex);
+    for(size_t i = 0; i < M_loops.size(); ++i)
+    {
+        WatchedLoop& w = M_loops[i];
+        const int64_t busySince = w.loop->busySince();
+        const int64_t iteration = w.loop->iteration();
+        if(w.stallBusySince != 0
+           && (busySince != w.stallBusySince || iteration != w.lastIteration))
+        {
+            endStall(&w);
+        }
+        w.lastIteration = iteration;
+
+        if(busySince != 0 && nowUs - busySince > M_stallBudgetUs)
+        {
+            w.stallBusySince = busySince;
+            w.lastSeenUs = nowUs;
+            if(!w.reported)
+            {
+                w.reported = true;
+                StallReport report;
+                report.loopName = w.name;
+                report.threadId = w.loop->threadId();
+                report.stalledUs = nowUs - busySince;
+                report.fd = w.loop->activeFd();
+                report.inPendingFunctors = w.loop->callingPendingFunctors();
+                if(report.fd >= 0)
+                {
+                    //the loop may have moved on and the fd been reused meanwhile,
+                    //keep the peer only if the loop is still in the same handler
+                    struct sockaddr_in6 peer = sockets::getPeerAddr(report.fd);
+                    if(peer.sin6_family != 0
+                       && w.loop->activeFd() == report.fd
+                       && w.loop->iteration() == iteration
+                       && w.loop->busySince() == busySince)
+                    {
+                        report.peer = InetAddress(peer).toIpPort();
+                    }
+                }
+                reports->push_back(report);
+            }
+        }
+    }
+}
+
+void LoopWatchdog::endStall(WatchedLoop* w)
+{
+    //a lower bound, the stall ended between two checks
+    const int64_t stalledUs = w->lastSeenUs - w->stallBusySince;
+    ++w->stats.stallCount;
+    w->stats.totalStallUs += stalledUs;
+    w->stats.maxStallUs = std::max(w->stats.maxStallUs, stalledUs);
+    w->stallBusySince = 0;
+    w->reported = false;
+}
+
+string LoopWatchdog::sampleStack(pid_t tid)
+{
+    MutexLockGuard lock(g_sampleMutex);
+    g_sampleSeq = g_sampleSeq == INT_MAX ? 1 : g_sampleSeq + 1;
+    const int seq = g_sampleSeq;
+    __atomic_store_n(&g_sampleArmed, seq, __ATOMIC_RELAXED);
+
+    //tgkill() can't carry the sequence number, rt_tgsigqueueinfo() can
+    siginfo_t info;
+    bzero(&info, sizeof(info));
+    info.si_signo = M_sampleSignal;
+    info.si_code = SI_QUEUE;
+    info.si_pid = ::getpid();
+    info.si_uid = ::getuid();
+    info.si_value.sival_int = seq;
+    if(::syscall(SYS_rt_tgsigqueueinfo, ::getpid(), tid, M_sampleSignal, &info) < 0)
+    {
+        __atomic_store_n(&g_sampleArmed, 0, __ATOMIC_RELAXED);
+        return string();
+    }
+
+    //wait up to 10ms for the handler to run in the loop thread
+    bool done = false;
+    for(int i = 0; i < 100 && !done; ++i)
+    {
+        CurrentThread::sleepUsec(100);
+        done = __atomic_load_n(&g_sampleDone, __ATOMIC_ACQUIRE) == seq;
+    }
+    if(!done)
+    {
+        int armed = seq;
+        if(__atomic_compare_exchange_n(&g_sampleArmed, &armed, 0, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            //withdrawn, a late handler finds 0 and writes nothing
+            return string();
+        }
+        //claimed just now, backtrace() is short
+        while(__atomic_load_n(&g_sampleDone, __ATOMIC_ACQUIRE) != seq)
+        {
+            CurrentThread::sleepUsec(100);
+        }
+    }
+    __atomic_store_n(&g_sampleArmed, 0, __ATOMIC_RELAXED);
+
+    string stack;
+    char** strings = ::backtrace_symbols(g_frames, g_numFrames);
+    if(strings)
+    {
+        for(int i = 0; i < g_numFrames; ++i)
+        {
+            stack.append(strings[i]);
+            stack.push_back('\n');
+        }
+        free(strings);
+    }
+    return stack;
+}
@@ -3,6 +3,7 @@
 #include "Logging.h"
 #include "Types.h"
 #include "Channel.h"
+#include "FastClock.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -21,8 +22,22 @@ Timestamp PollPoller::poll(int timeoutMs, ChannelList* activeChannels)
 {
     // XXX pollfds shouldn't change
     int numEvents = ::poll(&*M_pollfds.begin(), M_pollfds.size(), timeoutMs);
-    int savedErrno = errno;
-    Timestamp now(Timestamp::now());
+    return collectEvents(numEvents, errno, activeChannels);
+}
+
+Timestamp PollPoller::pollPrecise(int64_t timeoutNs, ChannelList* activeChannels)
+{
+    struct timespec timeout;
+    timeout.tv_sec = static_cast<time_t>(timeoutNs / (1000 * 1000 * 1000));
+    timeout.tv_nsec = static_cast<long>(timeoutNs % (1000 * 1000 * 1000));
+    int numEvents = ::ppoll(&*M_pollfds.begin(), M_pollfds.size(), &timeout, NULL);
+    return collectEvents(numEvents, errno, activeChannels);
+}
+
+Timestamp PollPoller::collectEvents(int numEvents, int savedErrno,
+                                    ChannelList* activeChannels) const
+{
+    Timestamp now(FastClock::now());
     if(numEvents > 0)
     {
         LOG_TRACE << numEvents << " events happended";
@@ -52,12 +67,11 @@ void PollPoller::fillActiveChannels(int numEvents,
         if(pfd->revents > 0)
         {
             --numEvents;
-            ChannelMap::const_iterator ch = M_channels.find(pfd->fd);
-            assert(ch != M_channels.end());
-            Channel* channel = ch->second;
+            Channel* channel = M_channels.find(pfd->fd);
+            assert(channel != NULL);
             assert(channel->fd() == pfd->fd);
             channel->set_revents(pfd->revents);
-            M_activeChannels.push_back(channel);
+            activeChannels->push_back(channel);
         }
     }
 } 
@@ -69,7 +83,7 @@ void PollPoller::updateChannel(Channel* channel)
     if(channel->index() < 0)
     {
         //a new one, add to pollfds
-        assert(M_channels.find(channel->fd()) == M_channels.end());
+        assert(M_channels.find(channel->fd()) == NULL);
         struct pollfd pfd;
         pfd.fd = channel->fd();
         pfd.events = static_cast<short>(channel->events())；
@@ -77,13 +91,12 @@ void PollPoller::updateChannel(Channel* channel)
         M_pollfds.push_back(pfd);
         int idx = static_cast<int>(M_pollfds.size())-1;
         channel->set_index(idx);
-        M_channels[pfd.fd] = channel;
+        M_channels.add(pfd.fd, channel);
     }
     else 
     {
         //update existing one 
-        assert(M_channels.find(channel->fd()) != M_channels.end());
-        assert(M_channels[channel->fd()] == channel);
+        assert(M_channels.find(channel->fd()) == channel);
         int idx = channel->index();
         assert(0 <= idx && idx < static_cast<int>(M_pollfds.size()));
         struct pollfd& pfd = M_pollfds[idx];
@@ -101,8 +114,7 @@ void PollPoller::removeChannel(Channel* channel)
 {
     Poller::assertInLoopThread();
     LOG_TRACE << " fd = " << channel->fd();
-    assert(M_channels.find(channel->fd()) != M_channels.end());
-    assert(M_channels[channel->fd] == channel);
+    assert(M_channels.find(channel->fd()) == channel);
     assert(channel->isNoneEvent());
     int idx = channel->index();
     assert(0 <= idx && idx < static_cast<int>(M_pollfds.size()));
@@ -122,7 +134,7 @@ void PollPoller::removeChannel(Channel* channel)
         {
             channelAtEnd = -channelAtEnd-1;
         }
-        M_channels[channelAtEnd]->set_index(idx);
+        M_channels.find(channelAtEnd)->set_index(idx);
         M_pollfds.pop_back();
     }
 }
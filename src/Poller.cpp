@@ -13,6 +13,5 @@ Poller::~Poller()
 bool Poller::hasChannel(Channel* channel) const 
 {
     assertInLoopThread();
-    ChannelMap::const_iterator it = M_channels.find(channel->fd());
-    return it != M_channels.end() && it->second == channel;
+    return M_channels.find(channel->fd()) == channel;
 }
\ No newline at end of file
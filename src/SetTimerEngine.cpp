@@ -0,0 +1,58 @@
+#include "SetTimerEngine.h"
+
+#include "Timer.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+SetTimerEngine::SetTimerEngine()
+{
+}
+
+SetTimerEngine::~SetTimerEngine()
+{
+}
+
+bool SetTimerEngine::insert(Timer* timer)
+{
+    assert(!timer->pending());
+    bool earliestChanged = false;
+    Timestamp when = timer->expiration();
+    TimerList::iterator it = M_timers.begin();
+    if(it == M_timers.end() || when < it->first)
+    {
+        earliestChanged = true;
+    }
+
+    std::pair<TimerList::iterator, bool> result
+        = M_timers.insert(Entry(when, timer));
+    assert(result.second); (void)result;
+    timer->M_index = 0;
+    return earliestChanged;
+}
+
+void SetTimerEngine::cancel(Timer* timer)
+{
+    assert(timer->pending());
+    size_t n = M_timers.erase(Entry(timer->expiration(), timer));
+    assert(n == 1); (void)n;
+    timer->M_index = -1;
+}
+
+void SetTimerEngine::getExpired(Timestamp now, std::vector<Timer*>* expired)
+{
+    Entry sentry(now, reinterpret_cast<Timer*>(UINTPTR_MAX));
+    TimerList::iterator end = M_timers.lower_bound(sentry);
+    assert(end == M_timers.end() || now < end->first);
+    for(TimerList::iterator it = M_timers.begin(); it != end; ++it)
+    {
+        it->second->M_index = -1;
+        expired->push_back(it->second);
+    }
+    M_timers.erase(M_timers.begin(), end);
+}
+
+Timestamp SetTimerEngine::nextWakeup()
+{
+    return M_timers.empty() ? Timestamp::invalid() : M_timers.begin()->first;
+}
@@ -53,7 +53,7 @@ void Socket::setReuseAddr(bool on)
 
 void Socket::setReusePort(bool on)
 {
-#ifdef SO_RESUEPORT
+#ifdef SO_REUSEPORT
     int optval = on ? 1 : 0;
     int ret = ::setsockopt(M_sockfd, SOL_SOCKET, SO_REUSEPORT,
                             &optval, static_cast<socklen_t>(sizeof(optval)));
@@ -67,7 +67,7 @@ void Socket::setReusePort(bool on)
       {
         //TODO:
       }
-#endif // SO_RESUEPORT
+#endif // SO_REUSEPORT
 }
 
 void Socket::setKeepAlive(bool on)
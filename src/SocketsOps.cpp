@@ -12,6 +12,7 @@ namespace
 {
     typedef struct sockaddr SA;
 
+#if defined(NO_ACCEPT4)
     void setNonBlockAndCloseOnExec(int sockfd)
     {
         int flags = ::fcntl(sockfd, F_GETFL, 0);
@@ -22,6 +23,7 @@ namespace
         flags |= FD_CLOEXEC;
         int ret = ::fcntl(sockfd, F_SETFD, flags);
     }
+#endif
 }
 
 const struct sockaddr* sockets::sockaddr_cast(const struct sockaddr_in6* addr)
@@ -51,12 +53,20 @@ const struct sockaddr_in6* sockets::sockaddr_in6_cast(const struct sockaddr* add
 
 int createNonblockingOrDie(sa_family_t family)
 {
-    int sockfd = socket(family, SOCK_STREAM, IPPROTO_TCP);
+#if defined(NO_ACCEPT4)
+    int sockfd = ::socket(family, SOCK_STREAM, IPPROTO_TCP);
     if(sockfd < 0)
     {
         //TODO:
     }
     setNonBlockAndCloseOnExec(sockfd);
+#else
+    int sockfd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if(sockfd < 0)
+    {
+        //TODO:
+    }
+#endif
     return sockfd;
 }
 
@@ -81,8 +91,15 @@ void  sockets::listenOrDie(int sockfd)
 int sockets::accept(int sockfd, const struct sockaddr* addr)
 {
     socklen_t addrlen = static_cast<socklen_t>(sizeof(*addr));
-    int connfd = :accept(sockfd, sockaddr_cast(addr), &addrlen);
+#if defined(NO_ACCEPT4)
+    int connfd = ::accept(sockfd, sockaddr_cast(addr), &addrlen);
     setNonBlockAndCloseOnExec(connfd);
+#else
+    // accept4(2) sets O_NONBLOCK and FD_CLOEXEC in the same syscall,
+    // saves the four fcntl(2) calls of setNonBlockAndCloseOnExec().
+    int connfd = ::accept4(sockfd, sockaddr_cast(addr),
+                           &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#endif
 
     if(connfd < 0)
     {
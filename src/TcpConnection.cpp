@@ -249,6 +249,18 @@ void TcpConnection::setTcpNoDelay(bool on)
     M_socket->setTcpNoDelay(on);
 }
 
+void TcpConnection::setEdgeTriggered(bool on)
+{
+    assert(M_state == kConnecting);
+    M_channel->setEdgeTriggered(on);
+}
+
+void TcpConnection::setPriority(int priority)
+{
+    assert(0 <= priority && priority < Channel::kNumPriorities);
+    M_channel->setPriority(static_cast<Channel::Priority>(priority));
+}
+
 void TcpConnection::startRead()
 {
     M_loop->runInLoop(boost::bind(&TcpConnection::startReadInLoop, this));
@@ -290,9 +302,27 @@ void TcpConnection::connectEstablished()
     M_connectionCallback(shared_from_this())；
 }
 
+void TcpConnection::connectDestroyed()
+{
+    M_loop->assertInLoopThread();
+    if(M_state == kConnected)
+    {
+        setState(kDisconnected);
+        M_channel->disableAll();
+
+        M_connectionCallback(shared_from_this());
+    }
+    M_channel->remove();
+}
+
 void TcpConnection::handleRead(Timestamp receiveTime)
 {
     M_loop->assertInLoopThread();
+    if(M_channel->isEdgeTriggered())
+    {
+        handleReadUntilAgain(receiveTime);
+        return;
+    }
     int savedErrno = 0;
     ssize_t n = M_inputBuffer.readFd(M_channel->fd(), &savedErrno);
     if(n > 0)
@@ -311,34 +341,94 @@ void TcpConnection::handleRead(Timestamp receiveTime)
     }
 }
 
+void TcpConnection::handleReadUntilAgain(Timestamp receiveTime)
+{
+    for(int i = 0; i < kMaxIoPerEvent; ++i)
+    {
+        int savedErrno = 0;
+        ssize_t n = M_inputBuffer.readFd(M_channel->fd(), &savedErrno);
+        if(n > 0)
+        {
+            M_messageCallback(shared_from_this(), &M_inputBuffer, receiveTime);
+            if(M_state == kDisconnected || !M_channel->isReading())
+            {
+                return;
+            }
+        }
+        else if(n == 0)
+        {
+            handleClose();
+            return;
+        }
+        else
+        {
+            if(savedErrno != EAGAIN && savedErrno != EWOULDBLOCK)
+            {
+                errno = savedErrno;
+                LOG_SYSERR << "TcpConnection::handleRead";
+                handleError();
+            }
+            return;
+        }
+    }
+    //budget used up before EAGAIN, no new edge will come for the data left,
+    //so carry on after the other channels of this iteration.
+    M_loop->queueInLoop(boost::bind(&TcpConnection::continueRead, shared_from_this()));
+}
+
+void TcpConnection::continueRead()
+{
+    M_loop->assertInLoopThread();
+    if((M_state == kConnected || M_state == kDisconnecting) && M_channel->isReading())
+    {
+        handleReadUntilAgain(M_loop->pollReturnTime());
+    }
+}
+
 void TcpConnection::handleWrite()
 {
     M_loop->assertInLoopThread();
     if(M_channel->isWriting())
     {
-        ssize_t n = sockets::write(M_channel->fd(),
-                                   M_outputBuffer.peek(),
-                                   M_outputBuffer.readableBytes());
-        if(n > 0)
+        //level-triggered writes once per event, edge-triggered until EAGAIN
+        const int maxWrites = M_channel->isEdgeTriggered() ? kMaxIoPerEvent : 1;
+        bool blocked = false;
+        for(int i = 0; i < maxWrites && M_outputBuffer.readableBytes() > 0; ++i)
         {
-            M_outputBuffer.retrieveAll();
-            if(M_outputBuffer.readableBytes() == 0)
+            ssize_t n = sockets::write(M_channel->fd(),
+                                       M_outputBuffer.peek(),
+                                       M_outputBuffer.readableBytes());
+            if(n > 0)
             {
-                M_channel->disableWriting();
-                if(M_writeCompleteCallback)
-                {
-                    M_loop->queueInLoop(boost::bind(M_writeCompleteCallback, shared_from_this));
-                }
-                if(M_state == kDisconnecting)
+                M_outputBuffer.retrieve(n);
+            }
+            else
+            {
+                if(errno != EWOULDBLOCK)
                 {
-                    shutdownInLoop();
+                    LOG_SYSERR << "TcpConnection::handleWrite";
                 }
+                blocked = true;
+                break;
             }
-        } 
-        else
+        }
+
+        if(M_outputBuffer.readableBytes() == 0)
+        {
+            M_channel->disableWriting();
+            if(M_writeCompleteCallback)
+            {
+                M_loop->queueInLoop(boost::bind(M_writeCompleteCallback, shared_from_this()));
+            }
+            if(M_state == kDisconnecting)
+            {
+                shutdownInLoop();
+            }
+        }
+        else if(M_channel->isEdgeTriggered() && !blocked)
         {
-            LOG_SYSERR << "TcpConnection::handleWrite";
-        }                          
+            M_loop->queueInLoop(boost::bind(&TcpConnection::continueWrite, shared_from_this()));
+        }
     }
     else
     {
@@ -347,6 +437,15 @@ void TcpConnection::handleWrite()
     }
 }
 
+void TcpConnection::continueWrite()
+{
+    M_loop->assertInLoopThread();
+    if(M_state != kDisconnected && M_channel->isWriting())
+    {
+        handleWrite();
+    }
+}
+
 void TcpConnection::handleClose()
 {
     M_loop->assertInLoopThread();
@@ -2,6 +2,7 @@
 
 #include "Logging.h"
 #include "Acceptor.h"
+#include "CountDownLatch.h"
 #include "EventLoop.h"
 #include "EventLoopThreadPool.h"
 #include "SocketsOps.h"
@@ -15,15 +16,21 @@ TcpServer::TcpServer(EventLoop* loop,
                      const string& nameArg,
                      Option option)
     : M_loop(CHECK_NOTNULL(loop)),
+      M_listenAddr(listenAddr),
       M_ipPort(listenAddr.toIpPort()),
       M_name(nameArg),
-      M_acceptor(new Acceptor(loop, listenAddr, option == kReusePort)),
+      M_option(option),
       M_threadPool(new EventLoopThreadPool(loop, M_name)),
       M_connectionCallback(defaultConnectionCallback),
       M_messageCallback(defaultMessageCallback),
+      M_edgeTriggered(false),
       M_nextConnId(1)
 {
-    M_acceptor->setNewConnectionCallback(boost::bind(&TcpServer::newConnection, this, _1, _2));
+    if(M_option != kReusePortPerLoop)
+    {
+        M_acceptor.reset(new Acceptor(loop, listenAddr, option == kReusePort));
+        M_acceptor->setNewConnectionCallback(boost::bind(&TcpServer::newConnection, this, _1, _2));
+    }
 } 
 
 TcpServer::~TcpServer()
@@ -39,8 +46,28 @@ TcpServer::~TcpServer()
         conn->getLoop()->runInLoop(boost::bind(&TcpConnection::connectDestroyed, conn));
         conn.reset();
     }
+
+    //acceptors and connections of I/O loops must be torn down in their own threads
+    CountDownLatch latch(static_cast<int>(M_loopAcceptors.size()));
+    for(size_t i = 0; i < M_loopAcceptors.size(); ++i)
+    {
+        LoopAcceptor* la = &M_loopAcceptors[i];
+        la->loop->runInLoop(boost::bind(&TcpServer::destroyLoopAcceptor, this, la, &latch));
+    }
+    latch.wait();
 } 
 
+TcpServer::LoopAcceptor::LoopAcceptor(EventLoop* loopArg, int indexArg)
+    : loop(loopArg),
+      index(indexArg),
+      nextConnId(1)
+{
+}
+
+TcpServer::LoopAcceptor::~LoopAcceptor()
+{
+}
+
 void TcpServer::setThreadNum(int numThreads)
 {
     assert(0 <= numThreads);
@@ -53,9 +80,26 @@ void TcpServer::start()
     {
         M_threadPool->start(M_threadInitCallback);
 
-        assert->(!M_acceptor->listening());
-        M_loop->runInLoop(boost::bind(&Acceptor::listen, 
-            get_pointer(M_acceptor)));
+        if(M_option == kReusePortPerLoop)
+        {
+            std::vector<EventLoop*> loops = M_threadPool->getAllLoops();
+            for(size_t i = 0; i < loops.size(); ++i)
+            {
+                LoopAcceptor* la = new LoopAcceptor(loops[i], static_cast<int>(i));
+                M_loopAcceptors.push_back(la);
+                la->acceptor.reset(new Acceptor(la->loop, M_listenAddr, true));
+                la->acceptor->setNewConnectionCallback(
+                    boost::bind(&TcpServer::newConnectionPerLoop, this, la, _1, _2));
+                la->loop->runInLoop(boost::bind(&Acceptor::listen,
+                    get_pointer(la->acceptor)));
+            }
+        }
+        else
+        {
+            assert(!M_acceptor->listenning());
+            M_loop->runInLoop(boost::bind(&Acceptor::listen, 
+                get_pointer(M_acceptor)));
+        }
     }
 } 
 
@@ -68,6 +112,31 @@ void TcpServer::newConnection(int sockfd, const InetAddress& peerAddr)
     ++M_nextConnId;
     string connName = M_name + buf;
 
+    TcpConnectionPtr conn(createConnection(ioLoop, connName, sockfd, peerAddr));
+    M_connections[connName] = conn;
+    conn->setCloseCallback(boost::bind(&TcpServer::removeConnection, this, _1));
+    ioLoop->runInLoop(boost::bind(&TcpConnection::connectEstablished, conn));
+} 
+
+void TcpServer::newConnectionPerLoop(LoopAcceptor* la, int sockfd, const InetAddress& peerAddr)
+{
+    la->loop->assertInLoopThread();
+    char buf[64];
+    snprintf(buf, sizeof(buf), "-%s#%d-%d", M_ipPort.c_str(), la->index, la->nextConnId);
+    ++la->nextConnId;
+    string connName = M_name + buf;
+
+    TcpConnectionPtr conn(createConnection(la->loop, connName, sockfd, peerAddr));
+    la->connections[connName] = conn;
+    conn->setCloseCallback(boost::bind(&TcpServer::removeConnectionPerLoop, this, la, _1));
+    conn->connectEstablished();
+}
+
+TcpConnectionPtr TcpServer::createConnection(EventLoop* ioLoop,
+                                             const string& connName,
+                                             int sockfd,
+                                             const InetAddress& peerAddr)
+{
     LOG_INFO << "TcpServer::newConnection [" << M_name
              << "] - new connection [" << connName
              << " from " << peerAddr.toIpPort();
@@ -78,13 +147,12 @@ void TcpServer::newConnection(int sockfd, const InetAddress& peerAddr)
                                             sockfd, 
                                             localAddr, 
                                             peerAddr));
-     M_connections[connName] = conn;
-     conn->setConnectionCallback(M_connectionCallback);
-     conn->setMessageCallback(M_messageCallback);
-     conn->setWriteCompleteCallback(M_writeCompleteCallback);
-     conn->setCloseCallback(boost::bind(&TcpServer::removeConnection, this, _1));
-     ipLoop->runInLoop(boost::bind(&TcpConnection::connectEstablished, conn));                                       
-} 
+    conn->setConnectionCallback(M_connectionCallback);
+    conn->setMessageCallback(M_messageCallback);
+    conn->setWriteCompleteCallback(M_writeCompleteCallback);
+    conn->setEdgeTriggered(M_edgeTriggered);
+    return conn;
+}
 
 void TcpServer::removeConnection(const TcpConnectionPtr& conn)
 {
@@ -101,4 +169,30 @@ void TcpServer::removeConnectionInLoop(const TcpConnectionPtr& conn)
     assert(n == 1);
     EventLoop* ioLoop = conn->getLoop;
     ioLoop->queueInLoop(boost::bind(&TcpConnection::connectDestroyed, conn));
-}                      
\ No newline at end of file
+}
+
+void TcpServer::removeConnectionPerLoop(LoopAcceptor* la, const TcpConnectionPtr& conn)
+{
+    la->loop->assertInLoopThread();
+    LOG_INFO << "TcpServer::removeConnectionPerLoop [" << M_name
+             << "] - connection " << conn->name();
+    size_t n = la->connections.erase(conn->name());
+    (void)n;
+    assert(n == 1);
+    la->loop->queueInLoop(boost::bind(&TcpConnection::connectDestroyed, conn));
+}
+
+void TcpServer::destroyLoopAcceptor(LoopAcceptor* la, CountDownLatch* latch)
+{
+    la->loop->assertInLoopThread();
+    la->acceptor.reset();
+    for(ConnectionMap::iterator it(la->connections.begin());
+        it != la->connections.end(); ++it)
+    {
+        TcpConnectionPtr conn = it->second;
+        it->second.reset();
+        la->loop->queueInLoop(boost::bind(&TcpConnection::connectDestroyed, conn));
+    }
+    la->connections.clear();
+    latch->countDown();
+}
@@ -0,0 +1,230 @@
+#include "ThreadPlacement.h"
+
+#include "Logging.h"
+
+#include <algorithm>
+#include <set>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+namespace
+{
+// parses "0-3,8,10-11" as found in /sys
+std::vector<int> readCpuList(const char* path)
+{
+    std::vector<int> cpus;
+    FILE* fp = ::fopen(path, "re");
+    if(fp == NULL)
+    {
+        return cpus;
+    }
+    char buf[4096];
+    if(::fgets(buf, sizeof(buf), fp) != NULL)
+    {
+        char* p = buf;
+        while(*p != '\0' && *p != '\n')
+        {
+            char* end = NULL;
+            long first = ::strtol(p, &end, 10);
+            if(end == p)
+            {
+                break;
+            }
+            long last = first;
+            p = end;
+            if(*p == '-')
+            {
+                last = ::strtol(p + 1, &end, 10);
+                p = end;
+            }
+            for(long cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(static_cast<int>(cpu));
+            }
+            if(*p == ',')
+            {
+                ++p;
+            }
+        }
+    }
+    ::fclose(fp);
+    return cpus;
+}
+
+std::vector<int> onlineNodes()
+{
+    return readCpuList("/sys/devices/system/node/online");
+}
+
+std::vector<int> cpusOfNode(int node)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    return readCpuList(path);
+}
+
+// hyperthread siblings of each physical core, ordered by their first cpu
+std::vector<std::vector<int> > physicalCores()
+{
+    std::set<std::vector<int> > cores;
+    std::vector<int> online = readCpuList("/sys/devices/system/cpu/online");
+    for(size_t i = 0; i < online.size(); ++i)
+    {
+        char path[96];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", online[i]);
+        std::vector<int> siblings = readCpuList(path);
+        if(siblings.empty())
+        {
+            siblings.push_back(online[i]);
+        }
+        cores.insert(siblings);
+    }
+    return std::vector<std::vector<int> >(cores.begin(), cores.end());
+}
+
+int nodeOfCpu(int cpu)
+{
+    std::vector<int> nodes = onlineNodes();
+    if(nodes.size() <= 1)
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        std::vector<int> cpus = cpusOfNode(nodes[i]);
+        if(std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+        {
+            return nodes[i];
+        }
+    }
+    return -1;
+}
+
+}
+
+ThreadPlacement ThreadPlacement::cpuList(const std::vector<int>& cpus)
+{
+    ThreadPlacement placement(kCpuList);
+    placement.M_cpus = cpus;
+    return placement;
+}
+
+ThreadPlacement ThreadPlacement::perPhysicalCore()
+{
+    return ThreadPlacement(kPerPhysicalCore);
+}
+
+ThreadPlacement ThreadPlacement::spreadNumaNodes()
+{
+    return ThreadPlacement(kSpreadNumaNodes);
+}
+
+std::vector<int> ThreadPlacement::cpusOf(int index) const
+{
+    std::vector<int> cpus;
+    switch(M_policy)
+    {
+    case kCpuList:
+        if(!M_cpus.empty())
+        {
+            cpus.push_back(M_cpus[index % M_cpus.size()]);
+        }
+        break;
+    case kPerPhysicalCore:
+    {
+        std::vector<std::vector<int> > cores = physicalCores();
+        if(!cores.empty())
+        {
+            cpus = cores[index % cores.size()];
+        }
+        break;
+    }
+    case kSpreadNumaNodes:
+    {
+        std::vector<int> nodes = onlineNodes();
+        if(!nodes.empty())
+        {
+            cpus = cpusOfNode(nodes[index % nodes.size()]);
+        }
+        break;
+    }
+    case kNone:
+        break;
+    }
+    return cpus;
+}
+
+int ThreadPlacement::nodeOf(int index) const
+{
+    if(M_policy == kSpreadNumaNodes)
+    {
+        std::vector<int> nodes = onlineNodes();
+        return nodes.size() > 1 ? nodes[index % nodes.size()] : -1;
+    }
+    std::vector<int> cpus = cpusOf(index);
+    return cpus.empty() ? -1 : nodeOfCpu(cpus.front());
+}
+
+bool ThreadPlacement::apply(int index) const
+{
+    if(M_policy == kNone)
+    {
+        return false;
+    }
+    std::vector<int> cpus = cpusOf(index);
+    if(cpus.empty())
+    {
+        LOG_WARN << "ThreadPlacement::apply() no cpus for thread " << index;
+        return false;
+    }
+
+    if(*std::min_element(cpus.begin(), cpus.end()) < 0)
+    {
+        LOG_WARN << "ThreadPlacement::apply() negative cpu for thread " << index;
+        return false;
+    }
+    // sized for the largest id, a cpu_set_t stops at CPU_SETSIZE
+    int maxCpu = *std::max_element(cpus.begin(), cpus.end());
+    cpu_set_t* set = CPU_ALLOC(maxCpu + 1);
+    if(set == NULL)
+    {
+        LOG_SYSERR << "ThreadPlacement::apply() CPU_ALLOC " << maxCpu + 1;
+        return false;
+    }
+    size_t setSize = CPU_ALLOC_SIZE(maxCpu + 1);
+    CPU_ZERO_S(setSize, set);
+    for(size_t i = 0; i < cpus.size(); ++i)
+    {
+        CPU_SET_S(cpus[i], setSize, set);
+    }
+    int ret = ::pthread_setaffinity_np(::pthread_self(), setSize, set);
+    CPU_FREE(set);
+    if(ret != 0)
+    {
+        LOG_WARN << "ThreadPlacement::apply() pthread_setaffinity_np " << strerror_tl(ret);
+        return false;
+    }
+
+    int node = nodeOf(index);
+    if(node >= 0 && node < static_cast<int>(sizeof(unsigned long) * 8))
+    {
+        unsigned long nodemask = 1UL << node;
+        if(::syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8) < 0)
+        {
+            LOG_SYSERR << "ThreadPlacement::apply() set_mempolicy node " << node;
+        }
+    }
+    return true;
+}
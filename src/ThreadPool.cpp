@@ -1,18 +1,81 @@
 #include "ThreadPool.h"
 #include "Exception.h"
+#include "FastClock.h"
 
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <assert.h>
+#include <math.h>
+#include <sched.h>
 #include <stdio.h>
 
+namespace
+{
+// the pool and index of the worker running in this thread, if any
+__thread ThreadPool* t_pool = NULL;
+__thread int t_workerIndex = -1;
+
+// times a class may be passed over while it has tasks, by ThreadPool::Priority
+const int kAgingPasses[ThreadPool::kNumPriorities] = { 0, 8, 32 };
+
+// take() rounds that find tasks counted but take none, spinning then yielding,
+// before a worker sleeps a while instead
+const int kMissSpins = 64;
+const int kMissYields = 16;
+const double kMissBackoffSeconds = 0.0001;
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// CoDel's next drop, sooner the more drops so far
+inline int64_t codelControlLaw(int64_t t, int64_t interval, uint32_t count)
+{
+    return t + static_cast<int64_t>(static_cast<double>(interval)
+                                    / sqrt(static_cast<double>(count)));
+}
+
+inline uint32_t nextRandom(uint32_t* seed)
+{
+    // xorshift32
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+}
+
 ThreadPool::ThreadPool(const string& nameArg)
     :M_mutex(),
      M_notEmpty(M_mutex),
      M_notFull(M_mutex),
      M_name(nameArg),
+     M_queued(0),
      M_maxQueueSize(0),
-     M_running(false)
+     M_maxQueueDelay(0),
+     M_codelTarget(0),
+     M_codelInterval(0),
+     M_codelFirstAbove(0),
+     M_codelDropNext(0),
+     M_codelCount(0),
+     M_codelLastCount(0),
+     M_codelDropping(false),
+     M_running(false),
+     M_sleepers(0),
+     M_missedDeadlines(0),
+     M_rejected(0),
+     M_shedTasks(0)
 {    
+    for(int p = 0; p < kNumPriorities; ++p)
+    {
+        M_injected[p] = 0;
+        M_pending[p] = 0;
+    }
 }
 
 ThreadPool::~ThreadPool()
@@ -26,13 +89,18 @@ ThreadPool::~ThreadPool()
 void ThreadPool::start(int numThreads)
 {
     assert(M_threads.empty());
-    M_running = true;
+    __atomic_store_n(&M_running, true, __ATOMIC_RELEASE);
+    M_workers.reserve(numThreads);
+    for(int i = 0; i < numThreads; ++i)
+    {
+        M_workers.push_back(new Worker(i));
+    }
     M_threads.reserve(numThreads);
     for(int i = 0; i < numThreads; ++i)
     {
         char id[32];
-        snprintf(id, sizeof(id), "%d", i+1)；
-        M_threads.push_back(new Thread(boost::bind(&ThreadPool::runInThread, this), M_name+id));
+        snprintf(id, sizeof(id), "%d", i+1);
+        M_threads.push_back(new Thread(boost::bind(&ThreadPool::runInThread, this, i), M_name+id));
         M_threads[i].start();
     }
 
@@ -47,83 +115,544 @@ void ThreadPool::stop()
     
     {
         MutexLockGuard lock(M_mutex);
-        M_running = false;
+        __atomic_store_n(&M_running, false, __ATOMIC_RELEASE);
         M_notEmpty.notifyAll();
     }
     for_each(M_threads.begin(),
              M_threads.end(),
              boost::bind(&Thread::join,_1));
-             
+    // as before, tasks not taken when stopping don't run
+    discardQueued();
 }
 
 size_t ThreadPool::queueSize() const 
 {
-    MutexLockGuard lock(M_mutex);
-    return M_queue.size();
+    int64_t total = 0;
+    for(int p = 0; p < kNumPriorities; ++p)
+    {
+        total += __atomic_load_n(&M_pending[p], __ATOMIC_RELAXED);
+    }
+    return total > 0 ? static_cast<size_t>(total) : 0;
 }
 
 void ThreadPool::run(const Task& task)
+{
+    run(task, kNormalPriority);
+}
+
+void ThreadPool::run(const Task& task, Priority priority, double timeout, const Task& missed)
 {
     if(M_threads.empty())
     {
         task();
+        return;
     }
-    else
+    int64_t now = FastClock::monotonicNow().microSecondsSinceEpoch();
+    enqueue(newTask(task, missed, now, timeout), priority);
+}
+
+ThreadPool::Admission ThreadPool::tryRun(const Task& task, Priority priority, double timeout, const Task& missed)
+{
+    //running it here would block the caller, which is what tryRun() avoids
+    if(M_threads.empty())
+    {
+        __atomic_add_fetch(&M_rejected, 1, __ATOMIC_RELAXED);
+        return kQueueFull;
+    }
+    int64_t now = FastClock::monotonicNow().microSecondsSinceEpoch();
+    QueuedTask* queued = newTask(task, missed, now, timeout);
+    queued->sheddable = true;
+
+    if(t_pool != this || !M_workers[t_workerIndex].deques[priority].push(queued))
+    {
+        Admission admission = kAdmitted;
+        {
+            MutexLockGuard lock(M_mutex);
+            if(isFull())
+            {
+                admission = kQueueFull;
+            }
+            else if(M_maxQueueDelay > 0 && oldestWait(priority, now) > M_maxQueueDelay)
+            {
+                admission = kOverloaded;
+            }
+            else
+            {
+                inject(queued, priority);
+            }
+        }
+        if(admission != kAdmitted)
+        {
+            delete queued;
+            __atomic_add_fetch(&M_rejected, 1, __ATOMIC_RELAXED);
+            return admission;
+        }
+    }
+    published(priority, 1);
+    return kAdmitted;
+}
+
+ThreadPool::QueuedTask* ThreadPool::newTask(const Task& task, const Task& missed, int64_t now, double timeout)
+{
+    QueuedTask* queued = new QueuedTask;
+    queued->task = task;
+    queued->missed = missed;
+    queued->enqueueTime = now;
+    queued->deadline = timeout > 0.0
+        ? now + static_cast<int64_t>(timeout * Timestamp::kMicroSecondsPerSecond)
+        : 0;
+    queued->sheddable = false;
+    queued->shed = false;
+    return queued;
+}
+
+void ThreadPool::enqueue(QueuedTask* task, int priority)
+{
+    bool inWorker = t_pool == this;
+    if(!inWorker || !M_workers[t_workerIndex].deques[priority].push(task))
     {
         MutexLockGuard lock(M_mutex);
-        while(isFull())
+        // a worker waiting for room could wait for itself
+        while(!inWorker && isFull())
         {
             M_notFull.wait();
         }
-        assert(!isFull());
+        inject(task, priority);
+    }
+    published(priority, 1);
+}
 
-        M_queue.push_back(task);
+void ThreadPool::inject(QueuedTask* task, int priority)
+{
+    M_mutex.assertLocked();
+    M_queues[priority].push_back(task);
+    ++M_queued;
+    __atomic_store_n(&M_injected[priority], M_queues[priority].size(), __ATOMIC_RELAXED);
+}
 
-        M_notEmpty.notify();
+void ThreadPool::published(int priority, size_t numTasks)
+{
+    __atomic_add_fetch(&M_pending[priority], static_cast<int64_t>(numTasks), __ATOMIC_SEQ_CST);
+    notifyIdle(numTasks);
+}
+
+// Heads of the injection queues of the classes served before this one.
+// Tasks in worker deques aren't counted, owners take the newest first
+// and no one else may look at them.
+int64_t ThreadPool::oldestWait(int priority, int64_t now) const
+{
+    M_mutex.assertLocked();
+    int64_t oldest = 0;
+    for(int p = 0; p <= priority; ++p)
+    {
+        if(!M_queues[p].empty())
+        {
+            int64_t wait = now - M_queues[p].front()->enqueueTime;
+            oldest = wait > oldest ? wait : oldest;
+        }
+    }
+    return oldest;
+}
+
+// CoDel (RFC 8289) on the time a task waited in the injection queues,
+// decided as it leaves them, @c emptied if no task of any class is left.
+// A whole interval of waits over the target means the queue stands
+// instead of absorbing a burst: tasks are shed, each drop sooner after
+// the last, until a wait is under the target again. Tasks from run()
+// count for the waits but are never shed.
+void ThreadPool::codelCheck(QueuedTask* task, int64_t now, bool emptied)
+{
+    M_mutex.assertLocked();
+    if(task->shed)
+    {
+        // decided already, it didn't fit into the worker's deque
+        return;
+    }
+    bool okToDrop = false;
+    if(now - task->enqueueTime < M_codelTarget || emptied)
+    {
+        M_codelFirstAbove = 0;
+    }
+    else if(M_codelFirstAbove == 0)
+    {
+        M_codelFirstAbove = now + M_codelInterval;
+    }
+    else
+    {
+        okToDrop = now >= M_codelFirstAbove;
+    }
+
+    if(M_codelDropping)
+    {
+        if(!okToDrop)
+        {
+            M_codelDropping = false;
+        }
+        else if(task->sheddable && now >= M_codelDropNext)
+        {
+            task->shed = true;
+            ++M_codelCount;
+            M_codelDropNext = codelControlLaw(M_codelDropNext, M_codelInterval, M_codelCount);
+        }
+    }
+    else if(okToDrop && task->sheddable)
+    {
+        task->shed = true;
+        M_codelDropping = true;
+        // dropping again soon after the last time resumes near its rate
+        uint32_t delta = M_codelCount - M_codelLastCount;
+        M_codelCount = delta > 1 && now - M_codelDropNext < 16 * M_codelInterval ? delta : 1;
+        M_codelDropNext = codelControlLaw(now, M_codelInterval, M_codelCount);
+        M_codelLastCount = M_codelCount;
+    }
+}
+
+void ThreadPool::runBatch(const std::vector<Task>& tasks, Priority priority)
+{
+    if(M_threads.empty())
+    {
+        for(size_t i = 0; i < tasks.size(); ++i)
+        {
+            tasks[i]();
+        }
+        return;
+    }
+    if(tasks.empty())
+    {
+        return;
+    }
+    // one clock read for the batch
+    int64_t now = FastClock::monotonicNow().microSecondsSinceEpoch();
+    std::vector<QueuedTask*> queued(tasks.size());
+    for(size_t i = 0; i < tasks.size(); ++i)
+    {
+        queued[i] = newTask(tasks[i], Task(), now, 0.0);
+    }
+
+    size_t i = 0;
+    size_t counted = 0;  // in M_pending
+    bool inWorker = t_pool == this;
+    if(inWorker)
+    {
+        Worker& self = M_workers[t_workerIndex];
+        while(i < queued.size() && self.deques[priority].push(queued[i]))
+        {
+            ++i;
+        }
+    }
+    if(i < queued.size())
+    {
+        MutexLockGuard lock(M_mutex);
+        for(; i < queued.size(); ++i)
+        {
+            while(!inWorker && isFull())
+            {
+                // let workers at what is queued so far
+                __atomic_add_fetch(&M_pending[priority], static_cast<int64_t>(i - counted), __ATOMIC_SEQ_CST);
+                counted = i;
+                M_notEmpty.notifyAll();
+                M_notFull.wait();
+            }
+            inject(queued[i], priority);
+        }
     }
+    published(priority, queued.size() - counted);
 }
 
-ThreadPool::Task ThreadPool::take()
+Histogram::Snapshot ThreadPool::queueWait(Priority priority) const
 {
+    if(M_workers.empty())
+    {
+        return Histogram().snapshot();
+    }
+    Histogram::Snapshot snap = M_workers[0].queueWait[priority].snapshot();
+    for(size_t i = 1; i < M_workers.size(); ++i)
+    {
+        snap.merge(M_workers[i].queueWait[priority].snapshot());
+    }
+    return snap;
+}
+
+// After the tasks are counted in M_pending. A parking worker counts itself
+// in M_sleepers before it reads M_pending, both seq_cst, so either it
+// sees the tasks or we see it and wake it under the lock it waits with.
+void ThreadPool::notifyIdle(size_t numTasks)
+{
+    int sleepers = __atomic_load_n(&M_sleepers, __ATOMIC_SEQ_CST);
+    if(sleepers > 0)
+    {
+        MutexLockGuard lock(M_mutex);
+        if(numTasks >= static_cast<size_t>(sleepers))
+        {
+            M_notEmpty.notifyAll();
+        }
+        else
+        {
+            for(size_t i = 0; i < numTasks; ++i)
+            {
+                M_notEmpty.notify();
+            }
+        }
+    }
+}
+
+ThreadPool::QueuedTask* ThreadPool::take(int index, int* priority)
+{
+    int misses = 0;
+    for(;;)
+    {
+        QueuedTask* task = takeNext(index, priority);
+        if(task != NULL)
+        {
+            return task;
+        }
+        if(!running())
+        {
+            return NULL;
+        }
+
+        // counted but not found: a steal lost its race, or the task was
+        // taken before its count dropped. Retry, but not at full speed.
+        if(misses < kMissSpins + kMissYields && totalPending() > 0)
+        {
+            if(++misses > kMissSpins)
+            {
+                sched_yield();
+            }
+            else
+            {
+                cpuRelax();
+            }
+            continue;
+        }
+
+        // park, unless a task came in meanwhile; after many misses only
+        // briefly, a notify for new work still ends it early
+        MutexLockGuard lock(M_mutex);
+        __atomic_add_fetch(&M_sleepers, 1, __ATOMIC_SEQ_CST);
+        bool counted = totalPending() > 0;
+        if(running())
+        {
+            if(!counted)
+            {
+                M_notEmpty.wait();
+                misses = 0;
+            }
+            else if(misses >= kMissSpins + kMissYields)
+            {
+                M_notEmpty.waitForSeconds(kMissBackoffSeconds);
+            }
+        }
+        __atomic_sub_fetch(&M_sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+int64_t ThreadPool::totalPending() const
+{
+    int64_t total = 0;
+    for(int p = 0; p < kNumPriorities; ++p)
+    {
+        total += pending(p);
+    }
+    return total;
+}
+
+// Highest class first, except one that has aged.
+ThreadPool::QueuedTask* ThreadPool::takeNext(int index, int* priority)
+{
+    Worker& self = M_workers[index];
+    for(int p = kNumPriorities - 1; p > 0; --p)
+    {
+        if(self.passes[p] >= kAgingPasses[p] && pending(p) > 0)
+        {
+            QueuedTask* task = takeClass(index, p);
+            if(task != NULL)
+            {
+                self.passes[p] = 0;
+                *priority = p;
+                return task;
+            }
+        }
+    }
+    for(int p = 0; p < kNumPriorities; ++p)
+    {
+        QueuedTask* task = takeClass(index, p);
+        if(task != NULL)
+        {
+            self.passes[p] = 0;
+            for(int lower = p + 1; lower < kNumPriorities; ++lower)
+            {
+                if(pending(lower) > 0)
+                {
+                    ++self.passes[lower];
+                }
+            }
+            *priority = p;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+ThreadPool::QueuedTask* ThreadPool::takeClass(int index, int priority)
+{
+    Worker& self = M_workers[index];
+    QueuedTask* task = self.deques[priority].pop();
+    if(task == NULL)
+    {
+        task = takeInjected(&self, priority);
+    }
+    if(task == NULL)
+    {
+        task = steal(index, priority);
+    }
+    if(task != NULL)
+    {
+        __atomic_sub_fetch(&M_pending[priority], 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Takes one task to run and moves up to a fair share more into
+// the worker's deque, where the others can steal them.
+ThreadPool::QueuedTask* ThreadPool::takeInjected(Worker* self, int priority)
+{
+    if(__atomic_load_n(&M_injected[priority], __ATOMIC_RELAXED) == 0)
+    {
+        return NULL;
+    }
     MutexLockGuard lock(M_mutex);
-    //always use a while-loop, due to spurious wakeup
-    while(M_queue.empty() && M_running)
+    std::deque<QueuedTask*>& queue = M_queues[priority];
+    if(queue.empty())
+    {
+        return NULL;
+    }
+    const bool codel = M_codelTarget > 0;
+    const int64_t now = codel ? FastClock::monotonicNow().microSecondsSinceEpoch() : 0;
+    QueuedTask* task = queue.front();
+    queue.pop_front();
+    if(codel)
     {
-        M_notEmpty.wait();
+        codelCheck(task, now, M_queued == 1);
     }
-    Task task;
-    if(!M_queue.empty())
+    size_t share = queue.size() / M_workers.size();
+    if(share > kMaxTakeBatch)
     {
-        task = M_queue.front();
-        M_queue.pop_front();
-        if(M_maxQueueSize > 0)
+        share = kMaxTakeBatch;
+    }
+    size_t moved = 0;
+    while(moved < share)
+    {
+        // before it is pushed, where others may steal it
+        if(codel)
+        {
+            codelCheck(queue.front(), now, M_queued - moved == 2);
+        }
+        if(!self->deques[priority].push(queue.front()))
         {
-            M_notFull.notify();
+            break;
         }
+        queue.pop_front();
+        ++moved;
+    }
+    M_queued -= moved + 1;
+    __atomic_store_n(&M_injected[priority], queue.size(), __ATOMIC_RELAXED);
+    if(M_maxQueueSize > 0)
+    {
+        M_notFull.notifyAll();
     }
     return task;
 }
 
+ThreadPool::QueuedTask* ThreadPool::steal(int index, int priority)
+{
+    size_t n = M_workers.size();
+    size_t start = nextRandom(&M_workers[index].seed) % n;
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t victim = (start + i) % n;
+        if(victim == static_cast<size_t>(index))
+        {
+            continue;
+        }
+        QueuedTask* task = M_workers[victim].deques[priority].steal();
+        if(task != NULL)
+        {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+void ThreadPool::runTask(Worker* self, int priority, const QueuedTask& task)
+{
+    int64_t now = FastClock::monotonicNow().microSecondsSinceEpoch();
+    self->queueWait[priority].record(now - task.enqueueTime);
+    if(task.shed || (task.deadline != 0 && now > task.deadline))
+    {
+        __atomic_add_fetch(task.shed ? &M_shedTasks : &M_missedDeadlines, 1, __ATOMIC_RELAXED);
+        if(task.missed)
+        {
+            task.missed();
+        }
+    }
+    else if(task.task)
+    {
+        task.task();
+    }
+}
+
+void ThreadPool::discardQueued()
+{
+    for(size_t i = 0; i < M_workers.size(); ++i)
+    {
+        for(int p = 0; p < kNumPriorities; ++p)
+        {
+            while(QueuedTask* task = M_workers[i].deques[p].steal())
+            {
+                delete task;
+            }
+        }
+    }
+    MutexLockGuard lock(M_mutex);
+    for(int p = 0; p < kNumPriorities; ++p)
+    {
+        for(std::deque<QueuedTask*>::iterator it = M_queues[p].begin(); it != M_queues[p].end(); ++it)
+        {
+            delete *it;
+        }
+        M_queues[p].clear();
+        __atomic_store_n(&M_injected[p], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&M_pending[p], 0, __ATOMIC_RELAXED);
+    }
+    M_queued = 0;
+}
+
 bool ThreadPool::isFull() const 
 {
     M_mutex.assertLocked();
-    return M_maxQueueSize > 0 && M_queue.size() >= M_maxQueueSize;
+    return M_maxQueueSize > 0 && M_queued >= M_maxQueueSize;
 }
 
-void ThreadPool::runInThread()
+void ThreadPool::runInThread(int index)
 {
+    t_pool = this;
+    t_workerIndex = index;
+    M_placement.apply(index);
     try
     {
         if(M_threadInitCallback)
         {
             M_threadInitCallback();
         }
-        while(M_running)
+        Worker& self = M_workers[index];
+        while(running())
         {
-            Task task(take());
+            int priority = kNormalPriority;
+            boost::scoped_ptr<QueuedTask> task(take(index, &priority));
             if(task)
             {
-                task();
+                runTask(&self, priority, *task);
             }
         }
     }
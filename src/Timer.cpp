@@ -1,6 +1,26 @@
 #include "Timer.h"
 
-AtomicInt64 Timer::s_numCreated;
+#include <assert.h>
+
+void Timer::reuse(const TimerCallback& cb, Timestamp when, double interval,
+                  double slack, bool precise)
+{
+    assert(M_index == -1);
+    M_callback = cb;
+    M_expiration = when;
+    M_interval = interval;
+    M_slack = static_cast<int64_t>(slack * Timestamp::kMicroSecondsPerSecond);
+    M_repeat = interval > 0.0;
+    M_precise = precise;
+    M_canceled = false;
+}
+
+void Timer::retire()
+{
+    assert(M_index == -1);
+    M_callback = TimerCallback();
+    __atomic_store_n(&M_generation, M_generation + 1, __ATOMIC_RELAXED);
+}
 
 void Timer::restart(Timestamp now)
 {
@@ -12,4 +32,4 @@ void Timer::restart(Timestamp now)
     {
         M_expiration = Timestamp::invalid();
     }
-}
\ No newline at end of file
+}
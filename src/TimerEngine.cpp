@@ -0,0 +1,40 @@
+#include "TimerEngine.h"
+#include "HeapTimerEngine.h"
+#include "SetTimerEngine.h"
+#include "WheelTimerEngine.h"
+
+#include <stdlib.h>
+
+TimerEngine::~TimerEngine()
+{
+}
+
+TimerEngine* TimerEngine::newTimerEngine(Kind kind, double tickSeconds)
+{
+    switch(kind)
+    {
+    case kWheelEngine:
+        return new WheelTimerEngine(tickSeconds);
+    case kHeapEngine:
+        return new HeapTimerEngine;
+    case kSetEngine:
+    default:
+        return new SetTimerEngine;
+    }
+}
+
+TimerEngine* TimerEngine::newDefaultTimerEngine()
+{
+    if(::getenv("MUDUO_USE_TIMER_WHEEL"))
+    {
+        return new WheelTimerEngine(0.001);
+    }
+    else if(::getenv("MUDUO_USE_TIMER_HEAP"))
+    {
+        return new HeapTimerEngine;
+    }
+    else
+    {
+        return new SetTimerEngine;
+    }
+}
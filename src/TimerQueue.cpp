@@ -2,11 +2,15 @@
 
 #include "Logging.h"
 #include "EventLoop.h"
+#include "FastClock.h"
+#include "HeapTimerEngine.h"
+#include "Histogram.h"
 #include "Timer.h"
 #include "TimerId.h"
 
 #include <boost/bind.hpp>
 
+#include <stdlib.h>
 #include <sys/timerfd.h>
 
 
@@ -23,18 +27,9 @@ int createTimerfd()
     return timerfd;                
 }
 
-struct timespec howMuchTimeFromNow(Timestamp when)
+struct timespec toTimespec(Timestamp when)
 {
-    int64_t microseconds = when.microSecondsSinceEpoch()
-                           - Timestamp::now.microSecondsSinceEpoch();
-    if( microseconds < 100)
-    {
-        microseconds  = 100;
-    }
-    struct timespec ts;
-    ts.tv_sec = static_cast<time_t>(
-        microseconds < 100;
-    )
+    int64_t microseconds = when.microSecondsSinceEpoch();
     struct timespec ts;
     ts.tv_sec = static_cast<time_t>(
         microseconds / Timestamp::kMicroSecondsPerSecond);
@@ -48,7 +43,7 @@ void readTimerfd(int timerfd, Timestamp now)
 {
     uint64_t howmany;
     ssize_t n = ::read(timerfd, &howmany, sizeof(howmany));
-    LOG_TRACE << "TimerQueue::handleRead() " << howmany << " at " << now.toString();
+    LOG_TRACE << "TimerQueue::handleRead() " << howmany << " at " << now.microSecondsSinceEpoch();
     if(n != sizeof(howmany))
     {
         LOG_ERROR << "TimerQueue::handleRead() reads " << n << "bytes instead of 8";
@@ -57,13 +52,12 @@ void readTimerfd(int timerfd, Timestamp now)
 
 void resetTimerfd(int timerfd, Timestamp expiration)
 {
-    // wake up loop by timerfd_settime()
+    // wake up loop by timerfd_settime(), at an absolute monotonic time,
+    // no clock read, fires at once if already past
     struct itimerspec newValue;
-    struct itimerspec oldValue;
     bzero(&newValue, sizeof(newValue));
-    bzero(&oldValue, sizeof(oldValue));
-    newValue.it_value = howMuchTimeFromNow(expiration);
-    int ret = ::timerfd_settime(timerfd, 0, &newValue, &oldValue);
+    newValue.it_value = toTimespec(expiration);
+    int ret = ::timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &newValue, NULL);
     if(ret)
     {
         LOG_SYSERR << "timerfd_settime()";
@@ -76,172 +70,492 @@ using namespace detail;
 
 TimerQueue::TimerQueue(EventLoop* loop)
     :M_loop(loop),
-     M_timerfd(createTimerfd()),
-     M_timerfdChannel(loop, M_timerfd),
-     M_timers(),
-     M_callingExpiredTimers(false)
+     M_timerfd(-1),
+     M_engine(TimerEngine::newDefaultTimerEngine()),
+     M_preciseEngine(new HeapTimerEngine),
+     M_lateness(NULL),
+     M_preciseLateness(NULL),
+     M_reprograms(0),
+     M_reprogramsSaved(0)
 {
-    M_timerfdChannel.setReadCallback(
-        boost::bind(&TimerQueue::handleRead, this));
-    //we are always reading the timerfd, we disarm it with timerfd_settime. 
-    M_TimerfdChannel.enableReading();
+    if(::getenv("MUDUO_POLL_DRIVEN_TIMERS") == NULL)
+    {
+        openTimerfd();
+    }
 }
 
 TimerQueue::~TimerQueue()
 {
-    M_timerfdChannel.disableAll();
-    M_timerfdChannel.remove();
-    ::close(M_timerfd);
-    for(TimerList::iterator it = M_timers.begin();
-        it != M_timers.end(); ++it)
+    if(M_timerfdChannel)
+    {
+        closeTimerfd();
+    }
+    M_engine.reset();
+    M_preciseEngine.reset();
+    for(std::vector<Timer*>::iterator it = M_slabs.begin();
+        it != M_slabs.end(); ++it)
     {
-        delete it->second;
+        delete[] *it;
     }
 }
 
 TimerId TimerQueue::addTimer(const TimerCallback& cb,
                              Timestamp when,
-                             double interval)
+                             double interval,
+                             double slack)
 {
-    Timer* timer = new Timer(cb, when, interval);
-    M_loop->runInLoop(boost::bind(&TimerQueue::addTimerInLoop, this, timer));
-    return TimerId(timer, timer->sequence());
+    Timer* timer = allocateTimer();
+    timer->reuse(cb, when, interval, slack, false);
+    return schedule(timer);
+}
+
+TimerId TimerQueue::addPreciseTimer(const TimerCallback& cb,
+                                    Timestamp when,
+                                    double interval)
+{
+    Timer* timer = allocateTimer();
+    timer->reuse(cb, when, interval, 0.0, true);
+    return schedule(timer);
+}
+
+TimerId TimerQueue::schedule(Timer* timer)
+{
+    TimerId timerId(timer, timer->generation());
+    if(M_loop->isInLoopThread())
+    {
+        addTimerInLoop(timer);
+    }
+    else
+    {
+        queuePending(&timer, 1, NULL, 0);
+    }
+    return timerId;
 }
 
 void TimerQueue::cancel(TimerId timerId)
 {
-    M_loop->runInLoop(boost::bind(&TimerQueue::cancelInLoop, this, timerId));
+    if(M_loop->isInLoopThread())
+    {
+        cancelInLoop(timerId);
+    }
+    else
+    {
+        queuePending(NULL, 0, &timerId, 1);
+    }
 } 
 
-void TimerQueue::addTimerInLoop(Timer* timer)
+void TimerQueue::addTimers(const std::vector<TimerSpec>& timers,
+                           int64_t offsetUs,
+                           std::vector<TimerId>* timerIds)
+{
+    if(timers.empty())
+    {
+        return;
+    }
+    std::vector<Timer*> added;
+    allocateTimers(timers.size(), &added);
+    timerIds->reserve(timerIds->size() + timers.size());
+    for(size_t i = 0; i < timers.size(); ++i)
+    {
+        const TimerSpec& spec = timers[i];
+        Timestamp when(spec.when.microSecondsSinceEpoch() + offsetUs);
+        added[i]->reuse(spec.callback, when, spec.interval, spec.slack, false);
+        timerIds->push_back(TimerId(added[i], added[i]->generation()));
+    }
+    if(M_loop->isInLoopThread())
+    {
+        Timestamp deadline;
+        for(size_t i = 0; i < added.size(); ++i)
+        {
+            insert(added[i], &deadline);
+        }
+        rearm(deadline);
+    }
+    else
+    {
+        queuePending(&added[0], added.size(), NULL, 0);
+    }
+}
+
+void TimerQueue::cancel(const std::vector<TimerId>& timerIds)
+{
+    if(timerIds.empty())
+    {
+        return;
+    }
+    if(M_loop->isInLoopThread())
+    {
+        for(size_t i = 0; i < timerIds.size(); ++i)
+        {
+            cancelInLoop(timerIds[i]);
+        }
+    }
+    else
+    {
+        queuePending(NULL, 0, &timerIds[0], timerIds.size());
+    }
+}
+
+void TimerQueue::setEngine(TimerEngine* engine)
 {
     M_loop->assertInLoopThread();
-    bool earliestChanged = insert(timer);
+    assert(M_engine->size() == 0);
+    M_engine.reset(engine);
+}
 
-    if(earliestChanged)
+void TimerQueue::setPollDriven(bool on)
+{
+    M_loop->assertInLoopThread();
+    if(on == pollDriven())
     {
-        resetTimerfd(M_timerfd, timer->expiration());
+        return;
     }
+    if(on)
+    {
+        closeTimerfd();
+    }
+    else
+    {
+        openTimerfd();
+        if(M_armed.valid())
+        {
+            resetTimerfd(M_timerfd, M_armed);
+        }
+    }
+}
+
+void TimerQueue::openTimerfd()
+{
+    M_timerfd = createTimerfd();
+    M_timerfdChannel.reset(new Channel(M_loop, M_timerfd));
+    M_timerfdChannel->setReadCallback(
+        boost::bind(&TimerQueue::handleRead, this));
+    M_timerfdChannel->setPriority(Channel::kTimerPriority);
+    //we are always reading the timerfd, we disarm it with timerfd_settime. 
+    M_timerfdChannel->enableReading();
+}
+
+void TimerQueue::closeTimerfd()
+{
+    M_timerfdChannel->disableAll();
+    M_timerfdChannel->remove();
+    M_timerfdChannel.reset();
+    ::close(M_timerfd);
+    M_timerfd = -1;
+}
+
+void TimerQueue::setLatenessHistograms(Histogram* lateness, Histogram* preciseLateness)
+{
+    M_loop->assertInLoopThread();
+    M_lateness = lateness;
+    M_preciseLateness = preciseLateness;
+}
+
+void TimerQueue::addTimerInLoop(Timer* timer)
+{
+    M_loop->assertInLoopThread();
+    Timestamp deadline;
+    insert(timer, &deadline);
+    rearm(deadline);
 }                           
 
+// Inserts the timer, lowering @c deadline to its own when the armed
+// wakeup is too late for it. The armed wakeup is never later than a
+// pending deadline, if it isn't later than this one either the timer
+// rides along with it, or is found pending at it and expire() arms
+// for the earliest deadline left.
+void TimerQueue::insert(Timer* timer, Timestamp* deadline)
+{
+    if(timer->canceled())
+    {
+        // canceled before it got here
+        recycle(timer);
+        return;
+    }
+    if(timer->precise())
+    {
+        // the loop reads preciseWakeup() before it polls
+        M_preciseEngine->insert(timer);
+        return;
+    }
+    bool earliestChanged = M_engine->insert(timer);
+    M_deadlines.insert(timer->deadline());
+
+    Timestamp own = timer->deadline();
+    if(M_armed.valid() && !(own < M_armed))
+    {
+        if(earliestChanged)
+        {
+            __atomic_store_n(&M_reprogramsSaved, M_reprogramsSaved + 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    if(deadline->valid())
+    {
+        // shares the reprogram of its batch
+        __atomic_store_n(&M_reprogramsSaved, M_reprogramsSaved + 1, __ATOMIC_RELAXED);
+        if(own < *deadline)
+        {
+            *deadline = own;
+        }
+    }
+    else
+    {
+        *deadline = own;
+    }
+}
+
+void TimerQueue::rearm(Timestamp deadline)
+{
+    if(deadline.valid())
+    {
+        // as late as the deadline allows, but no earlier than the engine
+        // can tell the timer expired, eg. the next tick of a wheel
+        Timestamp wakeup = M_engine->nextWakeup();
+        arm(wakeup < deadline ? deadline : wakeup);
+    }
+}
+
+void TimerQueue::queuePending(Timer* const* timers, size_t numTimers,
+                              const TimerId* timerIds, size_t numTimerIds)
+{
+    bool idle;
+    {
+        MutexLockGuard lock(M_pendingMutex);
+        idle = M_pendingAdds.empty() && M_pendingCancels.empty();
+        M_pendingAdds.insert(M_pendingAdds.end(), timers, timers + numTimers);
+        M_pendingCancels.insert(M_pendingCancels.end(), timerIds, timerIds + numTimerIds);
+    }
+    // one functor for everything queued until the loop takes it
+    if(idle)
+    {
+        M_loop->queueInLoop(boost::bind(&TimerQueue::doPendingTimers, this));
+    }
+}
+
+void TimerQueue::doPendingTimers()
+{
+    M_loop->assertInLoopThread();
+    std::vector<Timer*> adds;
+    std::vector<TimerId> cancels;
+    {
+        MutexLockGuard lock(M_pendingMutex);
+        adds.swap(M_pendingAdds);
+        cancels.swap(M_pendingCancels);
+    }
+
+    // adds first, a cancel may be for a timer of the same batch
+    Timestamp deadline;
+    for(size_t i = 0; i < adds.size(); ++i)
+    {
+        insert(adds[i], &deadline);
+    }
+    for(size_t i = 0; i < cancels.size(); ++i)
+    {
+        cancelInLoop(cancels[i]);
+    }
+    rearm(deadline);
+}
+
 void TimerQueue::cancelInLoop(TimerId timerId)
 {
     M_loop->assertInLoopThread();
-    assert(M_timers.size() == M_activeTimers.size());
-    ActiveTimer timer(timerId.M_timer,timerId.M_sequence);
-    ActiveTimerSet::iterator it = M_activeTimers.find(timer);
-    if(it != M_activeTimers.end())
+    Timer* timer = timerId.M_timer;
+    if(timer == NULL || timer->generation() != timerId.M_generation)
+    {
+        // already gone, the slot may be serving another timer
+        return;
+    }
+    if(timer->pending())
     {
-        size_t n = M_timers.erase(Entry(it->first->expiration(), it->first));
-        assert(n == 1); (void)n;
-        delete it->first; //FIXME : no delete please
-        M_activeTimers.erase(it);
+        if(timer->precise())
+        {
+            M_preciseEngine->cancel(timer);
+        }
+        else
+        {
+            M_engine->cancel(timer);
+            M_deadlines.erase(M_deadlines.find(timer->deadline()));
+        }
+        recycle(timer);
     }
-    else if(M_callingExpiredTimers)
+    else
     {
-        M_cancelingTimers.insert(timer);
+        // running, or not added yet: don't let it repeat or start
+        timer->cancel();
     }
-    assert(M_timers.size() == M_activeTimers.size());
 }
 
 void TimerQueue::handleRead()
 {
     M_loop->assertInLoopThread();
-    Timestamp now(Timestamp::now());
+    // loop time, expirations up to it are due. The timerfd fired on the
+    // kernel clock, when the TSC based loop time lags it the armed timers
+    // would look early and the timerfd, armed in the past, fire again at once.
+    Timestamp now(M_loop->monotonicNow());
+    Timestamp kernelNow(FastClock::systemMonotonicNow());
+    if(now < kernelNow)
+    {
+        now = kernelNow;
+    }
     readTimerfd(M_timerfd, now);
+    expire(now);
+}
 
-    std::vector<Entry> expired = getExpired(now);
-    M_callingExpiredTimers = true;
-    M_cancelingTimers.clear();
+void TimerQueue::runExpiredTimers()
+{
+    assert(pollDriven());
+    if(!M_armed.valid())
+    {
+        return;
+    }
+    // loop time, read after the poll
+    Timestamp now(M_loop->monotonicNow());
+    if(now < M_armed)
+    {
+        return;
+    }
+    expire(now);
+}
 
-    //safe to callback outside critical section
-    for(std::vector<Entry>::iterator it = expired.begin();
-        it != expired().end(); ++it)
+void TimerQueue::expire(Timestamp now)
+{
+    M_loop->assertInLoopThread();
+    std::vector<Timer*> expired;
+    M_engine->getExpired(now, &expired);
+    for(std::vector<Timer*>::const_iterator it = expired.begin();
+        it != expired.end(); ++it)
     {
-        it->second->run();
+        M_deadlines.erase(M_deadlines.find((*it)->deadline()));
     }
-    M_callingExpiredTimers = false;
+    runTimers(expired, now, M_lateness);
+    reset(expired, now);
 
-    reset(expired, now);       
+    // the timerfd is one-shot and has fired, or the poll timed out.
+    // Armed for the earliest deadline of the timers left, repeating ones
+    // included, so those with slack keep sharing wakeups.
+    if(M_deadlines.empty())
+    {
+        M_armed = Timestamp::invalid();
+    }
+    else
+    {
+        rearm(*M_deadlines.begin());
+    }
 }
 
-std::vector<TimerQueue::Enrty> TimerQueue::getExpired(Timestamp now)
+void TimerQueue::runPreciseTimers(Timestamp now)
 {
-    assert(M_timers.size() == M_activeTimers.size());
-    std::vector<Entry> expired;
-    Entry sentry(now, reinterpret_cast<Timer*>(UINTPTR_MAX));
-    TimerList::iterator end = M_timers.low_bound(sentry);
-    assert(end == M_timers.end() || now < end->first);
-    std::copy(M_timers.begin(), end, back_inserter(expired));
-    M_timers.erase(M_timers.beign(), end);
+    M_loop->assertInLoopThread();
+    std::vector<Timer*> expired;
+    M_preciseEngine->getExpired(now, &expired);
+    runTimers(expired, now, M_preciseLateness);
+    reset(expired, now);
+}
 
-    for(std::vector<Entry>::iterator it = expired.begin();
+void TimerQueue::runTimers(const std::vector<Timer*>& expired, Timestamp now, Histogram* lateness)
+{
+    //safe to callback outside critical section
+    for(std::vector<Timer*>::const_iterator it = expired.begin();
         it != expired.end(); ++it)
     {
-        ActiveTimer timer(it->second, it->second->sequence());
-        size_t n = M_activeTimers.erase(timer);
-        assert( n == 1); (void)n;
+        if(lateness != NULL)
+        {
+            lateness->record(now.microSecondsSinceEpoch()
+                             - (*it)->expiration().microSecondsSinceEpoch());
+        }
+        (*it)->run();
     }
-
-    assert(M_timers.size() == M_activeTimers.size());
-    return expired;
 }
 
-void TimerQueue::reset(const std::vector<Entry>& expired, Timestamp now)
+void TimerQueue::reset(const std::vector<Timer*>& expired, Timestamp now)
 {
-    Timestamp nextExpire;
-    for(std::vector<Entry>::const_iterator it = expired.begin();
+    for(std::vector<Timer*>::const_iterator it = expired.begin();
         it != expired.end(); ++it)
     {
-        ActiveTimer timer(it->second, it->second->sequence());
-        if(it->second->repeat() 
-           && M_cancelingTimers.find(timer) == M_cancelingTimers.end())
+        if((*it)->repeat() && !(*it)->canceled())
         {
-            it->second->restart(now);
-            insert(it->second);
+            (*it)->restart(now);
+            if((*it)->precise())
+            {
+                M_preciseEngine->insert(*it);
+            }
+            else
+            {
+                M_engine->insert(*it);
+                M_deadlines.insert((*it)->deadline());
+            }
         }
         else
         {
-            delete it->second;
+            recycle(*it);
         }   
     }
+}
 
-    if(!M_timer.empty())
+void TimerQueue::arm(Timestamp when)
+{
+    M_armed = when;
+    if(M_timerfdChannel)
     {
-        nextExpire = M_timers.begin()->second->expiration();
+        __atomic_store_n(&M_reprograms, M_reprograms + 1, __ATOMIC_RELAXED);
+        resetTimerfd(M_timerfd, when);
     }
+}
 
-    if(nextExpire.valid())
+Timer* TimerQueue::allocateTimer()
+{
+    if(M_loop->isInLoopThread() && !M_freeTimers.empty())
     {
-        resetTimerfd(M_timerfd, nextExpire);
+        Timer* timer = M_freeTimers.back();
+        M_freeTimers.pop_back();
+        return timer;
     }
+    std::vector<Timer*> timers;
+    allocateTimers(1, &timers);
+    return timers.back();
 }
 
-bool TimerQueue::insert(Timer* timer)
+void TimerQueue::allocateTimers(size_t n, std::vector<Timer*>* timers)
 {
-    M_loop->assertInLoopThread();
-    assert(M_timers.size() == M_activeTimers.size());
-    bool earliestChanged = false;
-    TimeStamp when = timer->expiration();
-    TimerList::iterator it = M_timers.begin();
-    if( it == M_timers.end() || when < it->first)
+    timers->reserve(timers->size() + n);
+    if(M_loop->isInLoopThread())
     {
-        earliestChanged = true;
+        while(n > 0 && !M_freeTimers.empty())
+        {
+            timers->push_back(M_freeTimers.back());
+            M_freeTimers.pop_back();
+            --n;
+        }
     }
-
+    if(n == 0)
     {
-        std::pair<TimerList::iterator, bool> result
-            = M_timers.insert(Entry(when, timer));
-        assert(result.second); (void result);
+        return;
     }
+    MutexLockGuard lock(M_poolMutex);
+    while(M_sharedFreeTimers.size() < n)
     {
-        std::pair<ActiveTimerSet::iterator, bool> result
-            = M_activeTimers.insert(ActiveTimer(timer, timer->sequence()));
-        assert(result.second); (void)result;
+        Timer* slab = new Timer[kTimersPerSlab];
+        M_slabs.push_back(slab);
+        for(size_t i = 0; i < kTimersPerSlab; ++i)
+        {
+            M_sharedFreeTimers.push_back(&slab[i]);
+        }
     }
-
-    assert(M_timers.size() == M_activeTimers.size());
-    
-    return earliestChanged;
+    timers->insert(timers->end(), M_sharedFreeTimers.end() - n, M_sharedFreeTimers.end());
+    M_sharedFreeTimers.resize(M_sharedFreeTimers.size() - n);
 }
 
+void TimerQueue::recycle(Timer* timer)
+{
+    timer->retire();
+    M_freeTimers.push_back(timer);
+    // hand a slab's worth back when other threads are the ones adding timers
+    if(M_freeTimers.size() >= 2 * kTimersPerSlab)
+    {
+        MutexLockGuard lock(M_poolMutex);
+        M_sharedFreeTimers.insert(M_sharedFreeTimers.end(),
+                                  M_freeTimers.end() - kTimersPerSlab, M_freeTimers.end());
+        M_freeTimers.resize(M_freeTimers.size() - kTimersPerSlab);
+    }
+}
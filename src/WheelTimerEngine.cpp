@@ -0,0 +1,198 @@
+#include "WheelTimerEngine.h"
+
+#include "FastClock.h"
+#include "Timer.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+WheelTimerEngine::WheelTimerEngine(double tickSeconds)
+    : M_tickUs(tickSeconds * Timestamp::kMicroSecondsPerSecond >= 1.0
+               ? static_cast<int64_t>(tickSeconds * Timestamp::kMicroSecondsPerSecond) : 1),
+      M_currentTick(FastClock::monotonicNow().microSecondsSinceEpoch() / M_tickUs),
+      M_armedTick(INT64_MAX),
+      M_size(0)
+{
+    bzero(M_buckets, sizeof(M_buckets));
+    bzero(M_levelCount, sizeof(M_levelCount));
+}
+
+WheelTimerEngine::~WheelTimerEngine()
+{
+}
+
+int64_t WheelTimerEngine::tickOf(Timestamp when) const
+{
+    // rounded up, never early
+    return (when.microSecondsSinceEpoch() + M_tickUs - 1) / M_tickUs;
+}
+
+bool WheelTimerEngine::insert(Timer* timer)
+{
+    assert(!timer->pending());
+    ++M_size;
+    place(timer);
+    return tickOf(timer->expiration()) < M_armedTick;
+}
+
+void WheelTimerEngine::cancel(Timer* timer)
+{
+    assert(timer->pending());
+    unlink(timer);
+    --M_size;
+}
+
+void WheelTimerEngine::getExpired(Timestamp now, std::vector<Timer*>* expired)
+{
+    drain(kDueBucket, expired);
+    const int64_t nowTick = now.microSecondsSinceEpoch() / M_tickUs;
+    while(M_currentTick < nowTick)
+    {
+        int64_t tick = nextBoundary();
+        if(tick < 0 || tick > nowTick)
+        {
+            M_currentTick = nowTick;
+            break;
+        }
+        M_currentTick = tick;
+        int top = 0;
+        while(top + 1 < kNumLevels
+              && (M_currentTick & ((int64_t(1) << (kLevelBits * (top + 1))) - 1)) == 0)
+        {
+            ++top;
+        }
+        for(int level = top; level > 0; --level)
+        {
+            cascade(level);
+        }
+        drain(static_cast<int>(M_currentTick & kSlotMask), expired);
+        drain(kDueBucket, expired);
+    }
+}
+
+Timestamp WheelTimerEngine::nextWakeup()
+{
+    if(M_buckets[kDueBucket] != NULL)
+    {
+        M_armedTick = M_currentTick;
+        return Timestamp(M_currentTick * M_tickUs);
+    }
+    int64_t tick = nextBoundary();
+    if(tick < 0)
+    {
+        M_armedTick = INT64_MAX;
+        return Timestamp::invalid();
+    }
+    M_armedTick = tick;
+    return Timestamp(tick * M_tickUs);
+}
+
+void WheelTimerEngine::place(Timer* timer)
+{
+    int64_t expires = tickOf(timer->expiration());
+    int64_t delta = expires - M_currentTick;
+    if(delta <= 0)
+    {
+        link(timer, kDueBucket);
+        return;
+    }
+    int level = 0;
+    while(level + 1 < kNumLevels && delta >= (int64_t(1) << (kLevelBits * (level + 1))))
+    {
+        ++level;
+    }
+    const int64_t span = int64_t(1) << (kLevelBits * kNumLevels);
+    if(delta >= span)
+    {
+        // waits for the top level to reach it, then placed again
+        expires = M_currentTick + span - 1;
+    }
+    link(timer, level * kSlotsPerLevel
+                + static_cast<int>((expires >> (kLevelBits * level)) & kSlotMask));
+}
+
+void WheelTimerEngine::link(Timer* timer, int bucket)
+{
+    timer->M_index = bucket;
+    timer->M_prev = NULL;
+    timer->M_next = M_buckets[bucket];
+    if(timer->M_next)
+    {
+        timer->M_next->M_prev = timer;
+    }
+    M_buckets[bucket] = timer;
+    if(bucket < kDueBucket)
+    {
+        ++M_levelCount[bucket / kSlotsPerLevel];
+    }
+}
+
+void WheelTimerEngine::unlink(Timer* timer)
+{
+    int bucket = timer->M_index;
+    assert(0 <= bucket && bucket <= kDueBucket);
+    if(timer->M_prev)
+    {
+        timer->M_prev->M_next = timer->M_next;
+    }
+    else
+    {
+        M_buckets[bucket] = timer->M_next;
+    }
+    if(timer->M_next)
+    {
+        timer->M_next->M_prev = timer->M_prev;
+    }
+    timer->M_prev = NULL;
+    timer->M_next = NULL;
+    timer->M_index = -1;
+    if(bucket < kDueBucket)
+    {
+        --M_levelCount[bucket / kSlotsPerLevel];
+    }
+}
+
+void WheelTimerEngine::cascade(int level)
+{
+    int bucket = level * kSlotsPerLevel
+                 + static_cast<int>((M_currentTick >> (kLevelBits * level)) & kSlotMask);
+    while(Timer* timer = M_buckets[bucket])
+    {
+        unlink(timer);
+        place(timer);
+    }
+}
+
+void WheelTimerEngine::drain(int bucket, std::vector<Timer*>* expired)
+{
+    while(Timer* timer = M_buckets[bucket])
+    {
+        unlink(timer);
+        --M_size;
+        expired->push_back(timer);
+    }
+}
+
+int64_t WheelTimerEngine::nextBoundary() const
+{
+    int level = 0;
+    while(level < kNumLevels && M_levelCount[level] == 0)
+    {
+        ++level;
+    }
+    if(level == kNumLevels)
+    {
+        return -1;
+    }
+    // first non-empty slot of the lowest busy level, or where the level above turns
+    const int shift = kLevelBits * level;
+    int64_t tick = ((M_currentTick >> shift) + 1) << shift;
+    int index = static_cast<int>((tick >> shift) & kSlotMask);
+    while(index != 0 && M_buckets[level * kSlotsPerLevel + index] == NULL)
+    {
+        tick += int64_t(1) << shift;
+        index = static_cast<int>((tick >> shift) & kSlotMask);
+    }
+    return tick;
+}
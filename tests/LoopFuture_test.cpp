@@ -0,0 +1,197 @@
+// Test for LoopFuture: values and void completions handed across loops,
+// chained with then(), and combined with whenAll() / whenAny().
+//
+// Work runs in worker loops, every continuation checks it runs in the
+// loop it was given.  The main loop quits once the last check is in.
+//
+// usage: LoopFuture_test
+
+#include "LoopFuture.h"
+
+#include "Atomic.h"
+#include "EventLoop.h"
+#include "EventLoopThread.h"
+
+#include <boost/bind.hpp>
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+namespace
+{
+
+const int kChecks = 8;
+
+EventLoop* g_main = NULL;
+AtomicInt32 g_failures;
+AtomicInt32 g_checks;
+
+void check(bool ok, const char* what)
+{
+    if(!ok)
+    {
+        fprintf(stderr, "FAIL: %s\n", what);
+        g_failures.increment();
+    }
+    if(g_checks.incrementAndGet() == kChecks)
+    {
+        g_main->quit();
+    }
+}
+
+int answer(EventLoop* loop)
+{
+    loop->assertInLoopThread();
+    return 42;
+}
+
+std::string describe(EventLoop* loop, int value)
+{
+    loop->assertInLoopThread();
+    char buf[32];
+    snprintf(buf, sizeof buf, "value %d", value);
+    return buf;
+}
+
+void touch(EventLoop* loop, int* counter)
+{
+    loop->assertInLoopThread();
+    ++*counter;
+}
+
+void checkString(EventLoop* loop, const std::string& s)
+{
+    check(loop->isInLoopThread() && s == "value 42", "then<string>");
+}
+
+void checkTouched(EventLoop* loop, const int* counter)
+{
+    check(loop->isInLoopThread() && *counter == 1, "runInLoopFuture<void>");
+}
+
+int afterVoid(EventLoop* loop, const int* counter)
+{
+    loop->assertInLoopThread();
+    return *counter + 1;
+}
+
+void checkAfterVoid(int value)
+{
+    check(value == 2, "LoopFuture<void>::then<int>");
+}
+
+void consume(EventLoop* loop, int* sink, int value)
+{
+    loop->assertInLoopThread();
+    *sink = value;
+}
+
+void checkConsumed(EventLoop* loop, const int* sink)
+{
+    check(loop->isInLoopThread() && *sink == 42, "then<void>");
+}
+
+void checkAll(const std::vector<int>& values)
+{
+    bool ok = values.size() == 3;
+    for(size_t i = 0; ok && i < values.size(); ++i)
+    {
+        ok = values[i] == static_cast<int>(i) * 10;
+    }
+    check(ok, "whenAll");
+}
+
+void checkEmptyAll(const std::vector<int>& values)
+{
+    check(values.empty(), "whenAll of none");
+}
+
+void checkAny(const std::pair<size_t, int>& first)
+{
+    check(first.first < 2 && first.second == static_cast<int>(first.first) + 7, "whenAny");
+}
+
+int times10(int i)
+{
+    return i * 10;
+}
+
+int plus7(int i)
+{
+    return i + 7;
+}
+
+void setLater(LoopPromise<void> promise)
+{
+    promise.setValue();
+}
+
+void checkLater()
+{
+    check(g_main->isInLoopThread(), "LoopPromise<void> set before then()");
+}
+
+void start(EventLoop* a, EventLoop* b)
+{
+    // value, then a value in another loop, then the main loop
+    runInLoopFuture<int>(a, boost::bind(&answer, a))
+        .then<std::string>(b, boost::bind(&describe, b, _1))
+        .then(g_main, boost::bind(&checkString, g_main, _1));
+
+    // void work, its completion seen in another loop
+    static int counter = 0;
+    LoopFuture<void> touched = runInLoopFuture<void>(a, boost::bind(&touch, a, &counter));
+    touched.then(b, boost::bind(&checkTouched, b, &counter));
+
+    // void work chained to a value
+    static int counter2 = 0;
+    runInLoopFuture<void>(a, boost::bind(&touch, a, &counter2))
+        .then<int>(b, boost::bind(&afterVoid, b, &counter2))
+        .then(g_main, boost::bind(&checkAfterVoid, _1));
+
+    // a value consumed by a function returning void
+    static int sink = 0;
+    runInLoopFuture<int>(a, boost::bind(&answer, a))
+        .then<void>(b, boost::bind(&consume, b, &sink, _1))
+        .then(g_main, boost::bind(&checkConsumed, g_main, &sink));
+
+    std::vector<LoopFuture<int> > all;
+    for(int i = 0; i < 3; ++i)
+    {
+        all.push_back(runInLoopFuture<int>(i % 2 ? a : b, boost::bind(&times10, i)));
+    }
+    whenAll(g_main, all).then(g_main, boost::bind(&checkAll, _1));
+    whenAll(g_main, std::vector<LoopFuture<int> >()).then(g_main, boost::bind(&checkEmptyAll, _1));
+
+    std::vector<LoopFuture<int> > any;
+    any.push_back(runInLoopFuture<int>(a, boost::bind(&plus7, 0)));
+    any.push_back(runInLoopFuture<int>(b, boost::bind(&plus7, 1)));
+    whenAny(g_main, any).then(g_main, boost::bind(&checkAny, _1));
+
+    // completed before the continuation is set
+    LoopPromise<void> later;
+    setLater(later);
+    later.future().then(g_main, boost::bind(&checkLater));
+}
+
+}
+
+int main()
+{
+    EventLoop loop;
+    g_main = &loop;
+    EventLoopThread threadA;
+    EventLoopThread threadB;
+    EventLoop* a = threadA.startLoop();
+    EventLoop* b = threadB.startLoop();
+
+    loop.runInLoop(boost::bind(&start, a, b));
+    loop.runAfter(10.0, boost::bind(&EventLoop::quit, &loop));
+    loop.loop();
+
+    bool ok = g_checks.get() == kChecks && g_failures.get() == 0;
+    printf("%d of %d checks, %d failed\n", g_checks.get(), kChecks, g_failures.get());
+    return ok ? 0 : 1;
+}
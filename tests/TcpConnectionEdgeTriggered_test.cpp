@@ -0,0 +1,326 @@
+// Stress test for the edge-triggered TcpConnection path
+// (handleReadUntilAgain / continueRead / continueWrite).
+//
+// An echo server in edge-triggered mode greets every connection with many
+// back-to-back small sends, then echoes whatever it receives.  Client threads
+// push large, partial and back-to-back writes without reading, so the echo
+// backs up in the server's output buffer, then drain and check every byte
+// against a position dependent pattern.  Each connection ends with a half
+// close from the client, which must be answered by an orderly close.
+//
+// usage: TcpConnectionEdgeTriggered_test [port]
+
+#include "TcpServer.h"
+
+#include "Atomic.h"
+#include "Buffer.h"
+#include "EventLoop.h"
+#include "InetAddress.h"
+#include "Thread.h"
+
+#include <boost/bind.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace
+{
+
+const int kIoThreads = 4;
+const int kClientThreads = 16;
+const int kConnectionsPerClient = 8;
+const int kGreetingSends = 1000;
+
+uint16_t g_port = 29870;
+
+AtomicInt32 g_failures;
+AtomicInt32 g_connected;
+AtomicInt32 g_disconnected;
+AtomicInt64 g_received;
+AtomicInt64 g_sent;
+
+/// Byte @c offset of stream @c seed, so that lost, duplicated or reordered
+/// bytes show up as mismatches.
+char patternByte(uint32_t seed, size_t offset)
+{
+    uint32_t x = static_cast<uint32_t>(offset) * 2654435761u + seed * 40503u;
+    return static_cast<char>(x >> 24);
+}
+
+void fillPattern(std::vector<char>* buf, uint32_t seed, size_t offset, size_t len)
+{
+    buf->resize(len);
+    for(size_t i = 0; i < len; ++i)
+    {
+        (*buf)[i] = patternByte(seed, offset + i);
+    }
+}
+
+size_t greetingSendSize(int i)
+{
+    return 1 + static_cast<size_t>(i * 37) % 509;
+}
+
+size_t greetingLength()
+{
+    size_t len = 0;
+    for(int i = 0; i < kGreetingSends; ++i)
+    {
+        len += greetingSendSize(i);
+    }
+    return len;
+}
+
+void fail(const char* what, int conn, size_t offset)
+{
+    fprintf(stderr, "connection %d: %s at offset %zu (errno %d)\n",
+            conn, what, offset, errno);
+    g_failures.increment();
+}
+
+void onConnection(const TcpConnectionPtr& conn)
+{
+    if(conn->connected())
+    {
+        g_connected.increment();
+        //back-to-back small sends, most of them land in the output buffer
+        std::vector<char> chunk;
+        size_t offset = 0;
+        for(int i = 0; i < kGreetingSends; ++i)
+        {
+            size_t len = greetingSendSize(i);
+            fillPattern(&chunk, 0, offset, len);
+            conn->send(&chunk[0], static_cast<int>(len));
+            offset += len;
+        }
+    }
+    else
+    {
+        g_disconnected.increment();
+    }
+}
+
+void onMessage(const TcpConnectionPtr& conn, Buffer* buf, Timestamp)
+{
+    g_received.add(static_cast<int64_t>(buf->readableBytes()));
+    conn->send(buf);
+}
+
+bool writeAll(int fd, const char* data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = ::write(fd, data, len);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/// Reads @c len bytes of stream @c seed and checks them, in reads of at
+/// most @c maxRead bytes so that the server sees partial drains.
+bool readAndVerify(int fd, int conn, uint32_t seed, size_t len, size_t maxRead)
+{
+    std::vector<char> buf(maxRead);
+    size_t offset = 0;
+    while(offset < len)
+    {
+        size_t want = std::min(maxRead, len - offset);
+        ssize_t n = ::read(fd, &buf[0], want);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            fail(n == 0 ? "unexpected EOF" : "read error", conn, offset);
+            return false;
+        }
+        for(ssize_t i = 0; i < n; ++i)
+        {
+            if(buf[i] != patternByte(seed, offset + i))
+            {
+                fail("byte mismatch", conn, offset + i);
+                return false;
+            }
+        }
+        offset += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/// Write sizes: one large write, runs of tiny back-to-back writes and
+/// odd sized partial ones.
+std::vector<size_t> writePlan(unsigned int* rng)
+{
+    std::vector<size_t> plan;
+    plan.push_back(1 << 20);
+    for(int i = 0; i < 200; ++i)
+    {
+        plan.push_back(1 + rand_r(rng) % 16);
+    }
+    plan.push_back(300000 + rand_r(rng) % 4096);
+    for(int i = 0; i < 64; ++i)
+    {
+        plan.push_back(1 + rand_r(rng) % 65536);
+    }
+    return plan;
+}
+
+void runConnection(int conn)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        fail("socket", conn, 0);
+        return;
+    }
+    //a wedged connection fails the test instead of hanging it
+    struct timeval tv = { 10, 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) < 0)
+    {
+        fail("connect", conn, 0);
+        ::close(fd);
+        return;
+    }
+
+    if(!readAndVerify(fd, conn, 0, greetingLength(), 4096))
+    {
+        ::close(fd);
+        return;
+    }
+
+    //write everything before reading anything back
+    unsigned int rng = static_cast<unsigned int>(conn) + 1;
+    uint32_t seed = static_cast<uint32_t>(conn) + 1;
+    std::vector<size_t> plan = writePlan(&rng);
+    std::vector<char> chunk;
+    size_t total = 0;
+    for(size_t i = 0; i < plan.size(); ++i)
+    {
+        fillPattern(&chunk, seed, total, plan[i]);
+        if(!writeAll(fd, &chunk[0], plan[i]))
+        {
+            fail("write error", conn, total);
+            ::close(fd);
+            return;
+        }
+        total += plan[i];
+    }
+    g_sent.add(static_cast<int64_t>(total));
+
+    if(!readAndVerify(fd, conn, seed, total, 1 + rand_r(&rng) % 100000))
+    {
+        ::close(fd);
+        return;
+    }
+
+    //half close, the server must close its side in response
+    ::shutdown(fd, SHUT_WR);
+    char c;
+    ssize_t n = ::read(fd, &c, 1);
+    if(n != 0)
+    {
+        fail("no orderly close", conn, total);
+    }
+    ::close(fd);
+}
+
+void clientThread(int index)
+{
+    //stop at the first failure, every later connection would only time out
+    for(int i = 0; i < kConnectionsPerClient && g_failures.get() == 0; ++i)
+    {
+        runConnection(index * kConnectionsPerClient + i);
+    }
+}
+
+void runClients(EventLoop* loop)
+{
+    boost::ptr_vector<Thread> clients;
+    for(int i = 0; i < kClientThreads; ++i)
+    {
+        clients.push_back(new Thread(boost::bind(&clientThread, i)));
+        clients.back().start();
+    }
+    for(int i = 0; i < kClientThreads; ++i)
+    {
+        clients[i].join();
+    }
+    loop->runInLoop(boost::bind(&EventLoop::quit, loop));
+}
+
+bool runServer(TcpServer::Option option, const char* name)
+{
+    g_connected.getAndSet(0);
+    g_disconnected.getAndSet(0);
+    g_received.getAndSet(0);
+    g_sent.getAndSet(0);
+    int failures = g_failures.get();
+
+    EventLoop loop;
+    InetAddress listenAddr(g_port, true);
+    TcpServer server(&loop, listenAddr, name, option);
+    server.setEdgeTriggered(true);
+    server.setThreadNum(kIoThreads);
+    server.setConnectionCallback(onConnection);
+    server.setMessageCallback(onMessage);
+    server.start();
+
+    Thread driver(boost::bind(&runClients, &loop), "driver");
+    driver.start();
+    loop.loop();
+    driver.join();
+
+    const int connections = kClientThreads * kConnectionsPerClient;
+    bool ok = g_failures.get() == failures
+              && g_connected.get() == connections
+              && g_disconnected.get() == connections
+              && g_received.get() == g_sent.get();
+    printf("%s: %s, %d/%d connections closed, %lld/%lld bytes echoed\n",
+           name, ok ? "ok" : "FAILED",
+           g_disconnected.get(), connections,
+           static_cast<long long>(g_received.get()),
+           static_cast<long long>(g_sent.get()));
+    return ok;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    if(argc > 1)
+    {
+        g_port = static_cast<uint16_t>(atoi(argv[1]));
+    }
+
+    bool ok = runServer(TcpServer::kNoReusePort, "EtShared");
+    ok = runServer(TcpServer::kReusePortPerLoop, "EtPerLoop") && ok;
+    return ok ? 0 : 1;
+}